@@ -0,0 +1,226 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Evaluates arithmetic functions given by their values at prime powers, such
+// as Euler's totient, over windows of consecutive numbers.
+//
+// Like `FactorSieve`, memory is proportional to the square root of the
+// largest number and the number of threads, not to the interval.
+
+#ifndef ZILLION_PRIMES_ARITHMETIC_H_
+#define ZILLION_PRIMES_ARITHMETIC_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "factor.h"
+#include "primality.h"
+
+// An arithmetic function `Function` is evaluated from the prime powers
+// `q = p^e` exactly dividing `n`. It provides:
+//
+// - `Value`, the type of its values.
+// - `static Value Identity()`, its value at 1.
+// - `static Value Power(uint64_t p, uint32_t e, uint64_t q)`, its value at
+//   `q`.
+// - `static Value Combine(Value a, Value b)`, which combines its values at
+//   coprime numbers. That is multiplication for multiplicative functions and
+//   addition for additive ones.
+// - Optionally `static constexpr Value kPrime`, its value at every prime, if
+//   it doesn't depend on the prime. This saves a division for each number
+//   with a prime factor above the square root of the largest number.
+
+// Euler's totient `phi(n)`, the count of numbers in [1, n] coprime to `n`.
+struct EulerPhi {
+  using Value = uint64_t;
+  static Value Identity() { return 1; }
+  static Value Power(uint64_t p, uint32_t, uint64_t q) {
+    return q / p * (p - 1);
+  }
+  static Value Combine(Value a, Value b) { return a * b; }
+};
+
+// The Moebius function `mu(n)`: 0 if a square divides `n`, otherwise -1 or 1
+// for an odd or even number of prime factors.
+struct Moebius {
+  using Value = int64_t;
+  static constexpr Value kPrime = -1;
+  static Value Identity() { return 1; }
+  static Value Power(uint64_t, uint32_t e, uint64_t) { return e == 1 ? -1 : 0; }
+  static Value Combine(Value a, Value b) { return a * b; }
+};
+
+// The number of divisors `d(n)`.
+struct DivisorCount {
+  using Value = uint64_t;
+  static constexpr Value kPrime = 2;
+  static Value Identity() { return 1; }
+  static Value Power(uint64_t, uint32_t e, uint64_t) { return e + 1; }
+  static Value Combine(Value a, Value b) { return a * b; }
+};
+
+// The sum of divisors `sigma(n)`. It can exceed 2^64 for `n` near 2^63.
+struct DivisorSum {
+  using Value = uint128_t;
+  static Value Identity() { return 1; }
+  static Value Power(uint64_t p, uint32_t, uint64_t q) {
+    return (static_cast<uint128_t>(q) * p - 1) / (p - 1);
+  }
+  static Value Combine(Value a, Value b) { return a * b; }
+};
+
+// The number of distinct prime factors `omega(n)`.
+struct DistinctPrimeFactors {
+  using Value = uint64_t;
+  static constexpr Value kPrime = 1;
+  static Value Identity() { return 0; }
+  static Value Power(uint64_t, uint32_t, uint64_t) { return 1; }
+  static Value Combine(Value a, Value b) { return a + b; }
+};
+
+// The number of prime factors counted with multiplicity `Omega(n)`.
+struct PrimeFactorCount {
+  using Value = uint64_t;
+  static constexpr Value kPrime = 1;
+  static Value Identity() { return 0; }
+  static Value Power(uint64_t, uint32_t e, uint64_t) { return e; }
+  static Value Combine(Value a, Value b) { return a + b; }
+};
+
+// Appends the values of `Function` at the numbers in [lo, hi] to `out`.
+// Requires `1 <= lo <= hi < lo + FactorSieve::kWindowSize`.
+//
+// Values start at `Identity()` and are combined with the value at each power
+// `q = p^e` of a base prime `p` exactly dividing the number, and finally with
+// the value at the prime cofactor, if any. The powers are multiplied up next
+// to the values instead of divided out of the numbers, so that only numbers
+// with a prime factor above `sqrt(hi)` need a division.
+template <typename Function>
+void EvaluateWindow(const FactorSieve& sieve, const int64_t lo,
+                    const int64_t hi,
+                    std::vector<typename Function::Value>& out) {
+  using Value = typename Function::Value;
+  // Marks the products of numbers already combined with the current `p`.
+  // Products are at most `hi < 2^63`, so the top bit is free.
+  constexpr uint64_t kDone = uint64_t{1} << 63;
+  const int64_t size = hi - lo + 1;
+  // Each value next to its product, so that a multiple of `p` touches a
+  // single cache line.
+  struct Partial {
+    Value value;
+    uint64_t product;
+  };
+  std::vector<Partial> partials(size, {Function::Identity(), 1});
+  // `powers[e] = p^e` for all `p^e <= hi`.
+  uint64_t powers[64] = {1};
+  for (const uint64_t p : sieve.primes()) {
+    if (p * p > static_cast<uint64_t>(hi)) {
+      break;
+    }
+    uint32_t largest = 1;
+    powers[1] = p;
+    while (static_cast<uint128_t>(powers[largest]) * p <=
+           static_cast<uint64_t>(hi)) {
+      powers[largest + 1] = powers[largest] * p;
+      largest++;
+    }
+    // The few multiples of higher powers go first, from the highest, so that
+    // each number is combined with its exact power of `p`.
+    for (uint32_t e = largest; e >= 2; e--) {
+      for (int64_t i = MinusMod(lo, powers[e]); i < size; i += powers[e]) {
+        Partial& partial = partials[i];
+        if ((partial.product & kDone) == 0) {
+          partial.value = Function::Combine(partial.value,
+                                            Function::Power(p, e, powers[e]));
+          partial.product = partial.product * powers[e] | kDone;
+        }
+      }
+    }
+    // The pass over all multiples skips those without a branch.
+    const Value value = Function::Power(p, 1, p);
+    for (int64_t i = MinusMod(lo, p); i < size; i += p) {
+      Partial& partial = partials[i];
+      const bool done = (partial.product & kDone) != 0;
+      partial.value =
+          done ? partial.value : Function::Combine(partial.value, value);
+      partial.product = done ? partial.product & ~kDone : partial.product * p;
+    }
+  }
+  for (int64_t i = 0; i < size; i++) {
+    const auto [value, product] = partials[i];
+    const uint64_t n = lo + i;
+    if (product == n) {
+      out.push_back(value);
+    } else if constexpr (requires { Function::kPrime; }) {
+      out.push_back(Function::Combine(value, Function::kPrime));
+    } else {
+      const uint64_t c = n / product;
+      out.push_back(Function::Combine(value, Function::Power(c, 1, c)));
+    }
+  }
+}
+
+// Appends `mu(n)` for `n` in [lo, hi] to `out`, faster than the general
+// evaluation.
+//
+// Each number gets the product of its distinct primes up to `sqrt(hi)`,
+// negated for each of them, so that its sign is `mu` so far. The product is
+// zeroed for multiples of squares. A number whose product falls short of it
+// has one more prime factor above `sqrt(hi)`. This keeps a single array and
+// needs no division at all.
+template <>
+inline void EvaluateWindow<Moebius>(const FactorSieve& sieve, const int64_t lo,
+                                    const int64_t hi,
+                                    std::vector<int64_t>& out) {
+  const int64_t size = hi - lo + 1;
+  std::vector<int64_t> products(size, 1);
+  for (const int64_t p : sieve.primes()) {
+    if (p * p > hi) {
+      break;
+    }
+    for (int64_t i = MinusMod(lo, p); i < size; i += p) {
+      products[i] *= -p;
+    }
+    for (int64_t i = MinusMod(lo, p * p); i < size; i += p * p) {
+      products[i] = 0;
+    }
+  }
+  for (int64_t i = 0; i < size; i++) {
+    const int64_t product = products[i];
+    const int64_t sign = (product > 0) - (product < 0);
+    out.push_back(product == lo + i || product == -(lo + i) ? sign : -sign);
+  }
+}
+
+// Calls `f` with `std::span<const Function::Value>` batches of the values of
+// `Function` at all numbers in [max(lo, 1), hi] in increasing order, sieving
+// windows in parallel on `threads` threads.
+template <typename Function, typename F>
+void ForArithmeticFunction(const int64_t lo, const int64_t hi,
+                           const int threads, F&& f) {
+  using Value = typename Function::Value;
+  ForFactorWindows<Value>(
+      std::max<int64_t>(lo, 1), hi, threads,
+      [](const FactorSieve& sieve, const int64_t lo, const int64_t hi,
+         std::vector<Value>& out) {
+        EvaluateWindow<Function>(sieve, lo, hi, out);
+      },
+      std::forward<F>(f));
+}
+
+#endif  // ZILLION_PRIMES_ARITHMETIC_H_
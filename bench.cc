@@ -0,0 +1,439 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks the parts of the sieve separately and end to end, and prints
+// the results as JSON to stdout, so that runs of different versions can be
+// compared.
+//
+// Each benchmark runs once to warm up and then `--repetitions` times. For
+// each it reports the time of every repetition, their mean, standard
+// deviation, minimum and maximum, and from the mean the time per number and
+// the primes per second. What the numbers and primes are depends on the
+// benchmark:
+//
+// - `base_primes/M`: Seeding the base primes for sieving up to `M`. The
+//   numbers of the seeded range, its primes.
+// - `range_sieve/CLASS`: `Range::Sieve` of a chunk near 1e16 by the base
+//   primes of a class, below `Indexer::kSize` (`row`), below `kChunkSize`
+//   (`chunk`) or above (`large`). The numbers of the chunk, the primes
+//   sieving it.
+// - `decode/VARIANT`: `Range::ForPrimes` and `Range::ForPrimeBatches` of
+//   sieved chunks. Their numbers and primes.
+// - `output/FORMAT`: Encoding primes as 64-bit little-endian numbers into
+//   memory, and passing them to `StdoutSink` one by one and in batches, and
+//   to `UringSink`. The primes count as numbers too.
+// - `next_prime/X`: `NextPrime` and `PrevPrime` of random numbers between
+//   `X / 2` and `X`.
+//   The numbers are the calls, the primes those found.
+// - `end_to_end/HI`: Emitting the primes of `--length` numbers up to `HI` to
+//   `StdoutSink`, including seeding. Their numbers and primes.
+//
+// `StdoutSink` writes to /dev/null, and the JSON goes to the original stdout.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "output.h"
+#include "sieve.h"
+
+constexpr char kUsage[] = R"(
+Benchmarks parts of the sieve and prints the results as JSON to stdout.
+
+Usage: bench [OPTION...]
+
+  --repetitions=R  Run each benchmark R times after warming up. Default 5.
+  --filter=TEXT    Only run benchmarks whose names contain TEXT.
+  --length=L       The numbers sieved by end_to_end benchmarks. Default 1e9.
+  --output=FILE    The file written by output/uring. Default /dev/null.
+)";
+
+// Command line options, as parsed by `ParseOptions`.
+struct Options {
+  int repetitions = 5;
+  std::string filter;
+  int64_t length = 1000000000;
+  std::string output = "/dev/null";
+};
+
+// Parses `argv` into `options`. Returns false on malformed arguments.
+bool ParseOptions(int argc, char* argv[], Options& options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const size_t equals = arg.find('=');
+    if (arg.rfind("--", 0) != 0 || equals == std::string::npos ||
+        equals + 1 == arg.size()) {
+      return false;
+    }
+    const std::string name = arg.substr(2, equals - 2);
+    const std::string value = arg.substr(equals + 1);
+    if (name == "repetitions") {
+      options.repetitions = std::stoi(value);
+    } else if (name == "filter") {
+      options.filter = value;
+    } else if (name == "length") {
+      options.length = std::stoll(value);
+    } else if (name == "output") {
+      options.output = value;
+    } else {
+      return false;
+    }
+  }
+  return options.repetitions > 0 && options.length > 0;
+}
+
+// Runs benchmarks and writes their results as a JSON object to `out`.
+class Benchmarks {
+ public:
+  Benchmarks(const Options& options, FILE* out)
+      : options_(options), out_(out) {
+    const char* simd =
+#if defined(__AVX512F__)
+        "avx512";
+#elif defined(__AVX2__)
+        "avx2";
+#else
+        "scalar";
+#endif
+    fprintf(out_, "{\n  \"simd\": \"%s\",\n  \"repetitions\": %d,\n", simd,
+            options_.repetitions);
+    fprintf(out_, "  \"benchmarks\": [");
+  }
+  Benchmarks(const Benchmarks&) = delete;
+  Benchmarks& operator=(const Benchmarks&) = delete;
+
+  ~Benchmarks() { fprintf(out_, "\n  ]\n}\n"); }
+
+  // Whether the benchmark `name` is selected by `--filter`.
+  bool Selected(const std::string& name) const {
+    return name.find(options_.filter) != std::string::npos;
+  }
+
+  // Whether any of the benchmarks `names` is `Selected`, so that setup shared
+  // by them is needed.
+  bool AnySelected(const std::span<const std::string> names) const {
+    return std::any_of(
+        names.begin(), names.end(),
+        [this](const std::string& name) { return Selected(name); });
+  }
+
+  // Times `run` unless it isn't `Selected`. Each call of `run` handles
+  // `numbers` numbers and returns the number of primes it handled.
+  void Run(const std::string& name, const int64_t numbers,
+           const std::function<int64_t()>& run) {
+    if (!Selected(name)) {
+      return;
+    }
+    int64_t primes = run();
+    std::vector<double> times;
+    for (int i = 0; i < options_.repetitions; i++) {
+      const auto start = std::chrono::steady_clock::now();
+      primes = run();
+      times.push_back(std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count());
+    }
+    double mean = 0;
+    for (const double time : times) {
+      mean += time / times.size();
+    }
+    double variance = 0;
+    for (const double time : times) {
+      variance += (time - mean) * (time - mean);
+    }
+    variance /= std::max<size_t>(times.size() - 1, 1);
+    fprintf(out_, "%s\n    {\"name\": \"%s\", \"numbers\": %lld, ",
+            first_ ? "" : ",", name.c_str(), static_cast<long long>(numbers));
+    fprintf(out_, "\"primes\": %lld,\n     \"times_ns\": [",
+            static_cast<long long>(primes));
+    for (size_t i = 0; i < times.size(); i++) {
+      fprintf(out_, "%s%.0f", i == 0 ? "" : ", ", times[i]);
+    }
+    fprintf(out_,
+            "],\n     \"mean_ns\": %.0f, \"stddev_ns\": %.0f, "
+            "\"min_ns\": %.0f, \"max_ns\": %.0f,\n",
+            mean, std::sqrt(variance),
+            *std::min_element(times.begin(), times.end()),
+            *std::max_element(times.begin(), times.end()));
+    fprintf(out_, "     \"ns_per_number\": %.4f, \"primes_per_second\": %.0f}",
+            mean / numbers, primes / mean * 1e9);
+    fflush(out_);
+    first_ = false;
+    std::cerr << name << ": " << mean / numbers << " ns/number" << std::endl;
+  }
+
+ private:
+  const Options& options_;
+  FILE* const out_;
+  bool first_ = true;
+};
+
+// Written by benchmarks so that the compiler can't optimize their work away.
+volatile uint64_t result;
+
+// Benchmarks seeding base primes.
+void BenchmarkBasePrimes(Benchmarks& benchmarks) {
+  for (const auto& [label, maximum] :
+       {std::pair<const char*, int64_t>{"1e12", 1000000000000},
+        {"1e16", 10000000000000000},
+        {"1e18", 1000000000000000000}}) {
+    const std::string name = std::string("base_primes/") + label;
+    if (!benchmarks.Selected(name)) {
+      continue;
+    }
+    const BasePrimes base(maximum);
+    benchmarks.Run(name, base.end(),
+                   [maximum] { return BasePrimes(maximum).range().Count(); });
+  }
+}
+
+// The offset of the chunks sieved by `BenchmarkRangeSieve` and
+// `BenchmarkDecode`, near 1e16.
+constexpr int64_t kOffset =
+    10000000000000000 / Indexer::kSize * Indexer::kSize;
+
+// The number of chunks decoded or encoded at once.
+constexpr int64_t kChunks = 16;
+
+// The chunks at `kOffset` shared by `BenchmarkRangeSieve`, `BenchmarkDecode`
+// and `BenchmarkOutput`, sieved only once a selected benchmark needs them.
+class Chunks {
+ public:
+  // The base primes for sieving the chunks.
+  const BasePrimes& base() {
+    if (base_ == nullptr) {
+      base_ =
+          std::make_unique<const BasePrimes>(kOffset + kChunks * kChunkSize);
+    }
+    return *base_;
+  }
+
+  // The `kChunks` sieved chunks.
+  const std::vector<Range>& ranges() {
+    if (ranges_.empty()) {
+      for (int64_t chunk = 0; chunk < kChunks; chunk++) {
+        ranges_.push_back(SieveChunk(base(), kOffset, chunk));
+      }
+    }
+    return ranges_;
+  }
+
+  // The primes of the chunks.
+  const std::vector<uint64_t>& primes() {
+    if (primes_.empty()) {
+      for (const Range& range : ranges()) {
+        range.ForPrimes([this, &range](const int64_t p) {
+          primes_.push_back(range.offset() + p);
+        });
+      }
+    }
+    return primes_;
+  }
+
+ private:
+  std::unique_ptr<const BasePrimes> base_;
+  std::vector<Range> ranges_;
+  std::vector<uint64_t> primes_;
+};
+
+// Benchmarks `Range::Sieve` by classes of base primes.
+void BenchmarkRangeSieve(Benchmarks& benchmarks, Chunks& chunks) {
+  const std::string names[] = {"range_sieve/row", "range_sieve/chunk",
+                               "range_sieve/large"};
+  if (!benchmarks.AnySelected(names)) {
+    return;
+  }
+  const int64_t root = std::sqrt(static_cast<long double>(kOffset)) + 1;
+  std::vector<int64_t> classes[3];
+  chunks.base().range().ForPrimes(
+      [&classes](const int64_t p) {
+        const uint64_t q = p;
+        classes[q < Indexer::kSize ? 0 : q < kChunkSize ? 1 : 2].push_back(p);
+      },
+      root);
+  for (int i = 0; i < 3; i++) {
+    benchmarks.Run(names[i], kChunkSize, [&primes = classes[i]] {
+      Range range(kOffset, kChunkLength);
+      for (const int64_t p : primes) {
+        range.Sieve(p);
+      }
+      result = range.words()[0];
+      return static_cast<int64_t>(primes.size());
+    });
+  }
+}
+
+// Benchmarks decoding sieved chunks into primes.
+void BenchmarkDecode(Benchmarks& benchmarks, Chunks& chunks) {
+  const std::string names[] = {"decode/for_primes",
+                               "decode/for_prime_batches"};
+  if (!benchmarks.AnySelected(names)) {
+    return;
+  }
+  const std::vector<Range>& ranges = chunks.ranges();
+  benchmarks.Run(names[0], kChunks * kChunkSize, [&ranges] {
+    int64_t count = 0;
+    uint64_t sum = 0;
+    for (const Range& range : ranges) {
+      range.ForPrimes([&count, &sum](const int64_t p) {
+        count++;
+        sum += p;
+      });
+    }
+    result = sum;
+    return count;
+  });
+  benchmarks.Run(names[1], kChunks * kChunkSize, [&ranges] {
+    std::vector<uint64_t> buffer(4096);
+    int64_t count = 0;
+    uint64_t sum = 0;
+    for (const Range& range : ranges) {
+      range.ForPrimeBatches(buffer,
+                            [&count, &sum](std::span<const uint64_t> primes) {
+                              count += primes.size();
+                              sum += primes.back();
+                            });
+    }
+    result = sum;
+    return count;
+  });
+}
+
+// Benchmarks encoding and writing the primes of `chunks`.
+void BenchmarkOutput(Benchmarks& benchmarks, const Options& options,
+                     Chunks& chunks) {
+  const std::string names[] = {"output/encode", "output/stdout_single",
+                               "output/stdout", "output/uring"};
+  if (!benchmarks.AnySelected(names)) {
+    return;
+  }
+  const std::vector<uint64_t>& primes = chunks.primes();
+  const int64_t count = primes.size();
+  benchmarks.Run(names[0], count, [&primes, count] {
+    std::vector<char> buffer(8 * primes.size());
+    for (size_t i = 0; i < primes.size(); i++) {
+      EncodeLittleEndian(primes[i], &buffer[8 * i]);
+    }
+    result = buffer.back();
+    return count;
+  });
+  benchmarks.Run(names[1], count, [&primes, count] {
+    StdoutSink sink;
+    for (const uint64_t p : primes) {
+      sink.Put(p);
+    }
+    fflush(stdout);
+    return count;
+  });
+  benchmarks.Run(names[2], count, [&primes, count] {
+    StdoutSink sink;
+    for (size_t i = 0; i < primes.size(); i += 4096) {
+      sink.Put(std::span(primes).subspan(
+          i, std::min<size_t>(4096, primes.size() - i)));
+    }
+    fflush(stdout);
+    return count;
+  });
+  benchmarks.Run(names[3], count, [&options, &primes, count] {
+    UringSink sink(options.output.c_str(), /*direct=*/false);
+    for (size_t i = 0; i < primes.size(); i += 4096) {
+      sink.Put(std::span(primes).subspan(
+          i, std::min<size_t>(4096, primes.size() - i)));
+    }
+    return count;
+  });
+}
+
+// Benchmarks `NextPrime` and `PrevPrime` of random numbers of various sizes.
+void BenchmarkNextPrime(Benchmarks& benchmarks) {
+  constexpr int kCalls = 10000;
+  for (const auto& [label, maximum] :
+       {std::pair<const char*, int64_t>{"1e9", 1000000000},
+        {"1e12", 1000000000000},
+        {"2^62", int64_t{1} << 62}}) {
+    std::mt19937_64 random(maximum);
+    std::vector<int64_t> numbers(kCalls / 2);
+    for (int64_t& x : numbers) {
+      x = std::uniform_int_distribution<int64_t>(maximum / 2, maximum)(random);
+    }
+    benchmarks.Run(std::string("next_prime/") + label, kCalls, [&numbers] {
+      uint64_t sum = 0;
+      for (const int64_t x : numbers) {
+        sum += NextPrime(x) + PrevPrime(x);
+      }
+      result = sum;
+      return kCalls;
+    });
+  }
+}
+
+// Benchmarks emitting primes of `--length` numbers below various bounds.
+void BenchmarkEndToEnd(Benchmarks& benchmarks, const Options& options) {
+  for (const auto& [name, hi] :
+       {std::pair<const char*, int64_t>{"1e9", 1000000000},
+        {"1e11", 100000000000},
+        {"1e13", 10000000000000}}) {
+    const int64_t lo = std::max<int64_t>(hi - options.length + 1, 0);
+    benchmarks.Run(std::string("end_to_end/") + name, hi - lo + 1, [lo, hi] {
+      StdoutSink sink;
+      int64_t count = 0;
+      std::vector<uint64_t> buffer(4096);
+      ForPrimeBatchesBetween(BasePrimes(hi), lo, hi, std::span(buffer),
+                             [&sink, &count](std::span<const uint64_t> batch) {
+                               sink.Put(batch);
+                               count += batch.size();
+                             });
+      fflush(stdout);
+      return count;
+    });
+  }
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    std::cerr << kUsage + 1;
+    return 1;
+  }
+  // Keep the original stdout for the results and send what the benchmarks
+  // write there to /dev/null.
+  FILE* const json = fdopen(dup(STDOUT_FILENO), "w");
+  if (json == nullptr || freopen("/dev/null", "w", stdout) == nullptr) {
+    Fail("stdout");
+  }
+  {
+    Benchmarks benchmarks(options, json);
+    BenchmarkBasePrimes(benchmarks);
+    Chunks chunks;
+    BenchmarkRangeSieve(benchmarks, chunks);
+    BenchmarkDecode(benchmarks, chunks);
+    BenchmarkOutput(benchmarks, options, chunks);
+    BenchmarkNextPrime(benchmarks);
+    BenchmarkEndToEnd(benchmarks, options);
+  }
+  fclose(json);
+  return 0;
+}
@@ -0,0 +1,235 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Factors all numbers in an interval at once by a segmented sieve, instead of
+// trial-dividing each of them.
+//
+// Results are produced as streams of 64-bit records, one per number in
+// increasing order:
+//
+// - Factorizations: the number of distinct prime factors `k`, followed by `k`
+//   pairs of a prime and its exponent, with primes increasing. 0 and 1 have
+//   `k = 0`.
+// - Smallest prime factors: a single number, the smallest prime factor.
+//   0 and 1 are their own smallest factors.
+
+#ifndef ZILLION_PRIMES_FACTOR_H_
+#define ZILLION_PRIMES_FACTOR_H_
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "sieve.h"
+
+// Sieves windows of consecutive numbers up to a given maximum for their prime
+// factors.
+class FactorSieve {
+ public:
+  // The most numbers in a window. Each base prime costs a division per window,
+  // so windows should be large compared to `sqrt(maximum) / log(maximum)`.
+  static constexpr int64_t kWindowSize = int64_t{1} << 18;
+
+  explicit FactorSieve(const int64_t maximum) {
+    const uint64_t root = std::sqrt(static_cast<long double>(maximum)) + 1;
+    for (const int64_t p : kWheelPrimes) {
+      primes_.push_back(p);
+    }
+    BasePrimes(maximum).range().ForPrimes(
+        [this](const int64_t p) { primes_.push_back(p); }, root);
+    while (!primes_.empty() &&
+           static_cast<uint64_t>(primes_.back()) * primes_.back() >
+               static_cast<uint64_t>(maximum)) {
+      primes_.pop_back();
+    }
+  }
+
+  // The primes up to the square root of the maximum, increasing.
+  const std::vector<uint32_t>& primes() const { return primes_; }
+
+  // Calls `f(i, p, e, q)` for each base prime `p` dividing number `lo + i` in
+  // [lo, hi], where `q = p^e` is the largest power of `p` dividing it, in
+  // increasing order of `p`. Requires `0 <= lo <= hi < lo + kWindowSize`.
+  //
+  // Each `p` divides its powers out of its multiples in the window, tracked
+  // in `cofactors`. After that, `cofactors[i]` holds what is left of `lo + i`,
+  // which is 1 or a single prime above all primes passed to `f` for it. 0 is
+  // left alone, with cofactor 0.
+  template <typename F>
+  void ForPrimePowers(const int64_t lo, const int64_t hi,
+                      std::vector<uint64_t>& cofactors, F&& f) const {
+    const int64_t size = hi - lo + 1;
+    cofactors.resize(size);
+    for (int64_t i = 0; i < size; i++) {
+      cofactors[i] = lo + i;
+    }
+    for (const uint32_t p : primes_) {
+      if (static_cast<uint64_t>(p) * p > static_cast<uint64_t>(hi)) {
+        break;
+      }
+      for (int64_t i = lo == 0 ? p : MinusMod(lo, p); i < size; i += p) {
+        uint64_t c = cofactors[i];
+        uint32_t exponent = 0;
+        uint64_t power = 1;
+        if (p == 2) {
+          exponent = std::countr_zero(c);
+          c >>= exponent;
+          power <<= exponent;
+        } else {
+          do {
+            c /= p;
+            exponent++;
+            power *= p;
+          } while (c % p == 0);
+        }
+        cofactors[i] = c;
+        f(i, p, exponent, power);
+      }
+    }
+  }
+
+  // Appends factorization records of the numbers in [lo, hi] to `out`.
+  // Requires `0 <= lo <= hi < lo + kWindowSize`.
+  void Factorize(const int64_t lo, const int64_t hi,
+                 std::vector<uint64_t>& out) const {
+    const int64_t size = hi - lo + 1;
+    std::vector<uint64_t> cofactors;
+    std::vector<Hit> hits;
+    hits.reserve(4 * size);
+    ForPrimePowers(lo, hi, cofactors,
+                   [&hits](const int64_t i, const uint32_t p,
+                           const uint32_t exponent, uint64_t) {
+                     hits.push_back({static_cast<uint32_t>(i), p, exponent});
+                   });
+    // Group the hits by number, keeping the primes of each increasing.
+    std::vector<uint32_t> starts(size + 1);
+    for (const Hit& hit : hits) {
+      starts[hit.index + 1]++;
+    }
+    for (int64_t i = 0; i < size; i++) {
+      starts[i + 1] += starts[i];
+    }
+    std::vector<Hit> sorted(hits.size());
+    {
+      std::vector<uint32_t> at(starts.begin(), starts.end() - 1);
+      for (const Hit& hit : hits) {
+        sorted[at[hit.index]++] = hit;
+      }
+    }
+    for (int64_t i = 0; i < size; i++) {
+      const bool prime_cofactor = cofactors[i] > 1;
+      out.push_back(starts[i + 1] - starts[i] + prime_cofactor);
+      for (uint32_t j = starts[i]; j < starts[i + 1]; j++) {
+        out.push_back(sorted[j].prime);
+        out.push_back(sorted[j].exponent);
+      }
+      if (prime_cofactor) {
+        out.push_back(cofactors[i]);
+        out.push_back(1);
+      }
+    }
+  }
+
+  // Appends the smallest prime factors of the numbers in [lo, hi] to `out`.
+  // Requires `0 <= lo <= hi < lo + kWindowSize`.
+  //
+  // The smallest prime factor of a composite `n` is at most `sqrt(n)`, so
+  // each base prime `p` marks only from `p * p` on. Going from the largest
+  // prime down, the smallest one overwrites all others.
+  void SmallestFactors(const int64_t lo, const int64_t hi,
+                       std::vector<uint64_t>& out) const {
+    const int64_t size = hi - lo + 1;
+    std::vector<uint32_t> factors(size);
+    const auto end = std::upper_bound(
+        primes_.begin(), primes_.end(), static_cast<uint64_t>(hi),
+        [](const uint64_t x, const uint64_t p) { return x < p * p; });
+    for (auto it = end; it != primes_.begin();) {
+      const uint64_t p = *--it;
+      for (uint64_t i = std::max<uint64_t>(
+                            static_cast<uint64_t>(lo) + MinusMod(lo, p),
+                            p * p) -
+                        lo;
+           i < static_cast<uint64_t>(size); i += p) {
+        factors[i] = p;
+      }
+    }
+    for (int64_t i = 0; i < size; i++) {
+      out.push_back(factors[i] != 0 ? factors[i] : lo + i);
+    }
+  }
+
+ private:
+  // Prime `prime` divides the number at `index` of a window `exponent` times.
+  struct Hit {
+    uint32_t index;
+    uint32_t prime;
+    uint32_t exponent;
+  };
+
+  // All primes up to the square root of the maximum, increasing. They all fit
+  // into `uint32_t` as the maximum is below 2^63.
+  std::vector<uint32_t> primes_;
+};
+
+// Calls `f` with `std::span<const T>` batches of records, computed by
+// `window(sieve, lo, hi, out)` into a `std::vector<T>` for windows of
+// `window_size <= FactorSieve::kWindowSize` numbers covering [lo, hi], in
+// increasing order, see `ForWindowsInOrder`.
+template <typename T, typename Window, typename F>
+void ForFactorWindows(int64_t lo, const int64_t hi, const int threads,
+                      Window&& window, F&& f,
+                      const int64_t window_size = FactorSieve::kWindowSize) {
+  lo = std::max<int64_t>(lo, 0);
+  if (hi < lo) {
+    return;
+  }
+  const FactorSieve sieve(hi);
+  ForWindowsInOrder<T>(
+      lo, hi, window_size, threads,
+      [&sieve, &window](const int64_t lo, const int64_t hi,
+                        std::vector<T>& out) { window(sieve, lo, hi, out); },
+      std::forward<F>(f));
+}
+
+// Calls `f` with batches of factorization records, described at the top of
+// this file, of all numbers in [lo, hi] in increasing order, using `threads`
+// threads.
+template <typename F>
+void ForFactorizations(const int64_t lo, const int64_t hi, const int threads,
+                       F&& f) {
+  ForFactorWindows<uint64_t>(
+      lo, hi, threads,
+      [](const FactorSieve& sieve, const int64_t lo, const int64_t hi,
+         std::vector<uint64_t>& out) { sieve.Factorize(lo, hi, out); },
+      std::forward<F>(f));
+}
+
+// Calls `f` with batches of the smallest prime factors of all numbers in
+// [lo, hi] in increasing order, using `threads` threads.
+template <typename F>
+void ForSmallestFactors(const int64_t lo, const int64_t hi, const int threads,
+                        F&& f) {
+  ForFactorWindows<uint64_t>(
+      lo, hi, threads,
+      [](const FactorSieve& sieve, const int64_t lo, const int64_t hi,
+         std::vector<uint64_t>& out) { sieve.SmallestFactors(lo, hi, out); },
+      std::forward<F>(f));
+}
+
+#endif  // ZILLION_PRIMES_FACTOR_H_
@@ -0,0 +1,213 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Statistics of gaps between consecutive primes, read directly from the bits
+// of sieved `Range`-s: a histogram, the first occurrence of each gap, and the
+// records of maximal gaps and of their merit `gap / ln(p)`.
+
+#ifndef ZILLION_PRIMES_GAPS_H_
+#define ZILLION_PRIMES_GAPS_H_
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "sieve.h"
+#include "tuples.h"
+
+// A gap of `length` between prime `prime` and the next prime.
+struct PrimeGap {
+  int64_t prime;
+  int64_t length;
+
+  double merit() const { return length / std::log(prime); }
+};
+
+// The gap statistics of an interval.
+struct GapStats {
+  // Gaps shorter than `min_gap` are ignored.
+  int64_t min_gap = 1;
+  // The first and last prime of the interval, or -1 if it has none.
+  int64_t first = -1;
+  int64_t last = -1;
+  // `counts[g]` is the number of gaps of length `g`.
+  std::vector<int64_t> counts;
+  // `firsts[g]` is the first prime followed by a gap of length `g`, or -1.
+  std::vector<int64_t> firsts;
+  // The gaps longer than all previous ones, in increasing order.
+  std::vector<PrimeGap> maximal;
+  // The gaps with a merit higher than all previous ones, in increasing order.
+  std::vector<PrimeGap> merit;
+
+  // Adds the gap after `prime` to the histogram.
+  void Count(const int64_t prime, const int64_t length) {
+    if (std::ssize(counts) <= length) {
+      counts.resize(length + 1);
+      firsts.resize(length + 1, -1);
+    }
+    counts[length]++;
+    if (firsts[length] < 0 || prime < firsts[length]) {
+      firsts[length] = prime;
+    }
+  }
+
+  // Adds the gap after `prime` to the records.
+  void Record(const int64_t prime, const int64_t length) {
+    const PrimeGap gap = {prime, length};
+    if (maximal.empty() || length > maximal.back().length) {
+      maximal.push_back(gap);
+    }
+    if (merit.empty() || gap.merit() > merit.back().merit()) {
+      merit.push_back(gap);
+    }
+  }
+
+  // Adds the next prime `p` of the interval.
+  void Add(const int64_t p) {
+    if (last >= 0 && p - last >= min_gap) {
+      Count(last, p - last);
+      Record(last, p - last);
+    }
+    if (first < 0) {
+      first = p;
+    }
+    last = p;
+  }
+
+  // Merges the histogram of `other` into this one.
+  void MergeCounts(const GapStats& other) {
+    if (counts.size() < other.counts.size()) {
+      counts.resize(other.counts.size());
+      firsts.resize(other.counts.size(), -1);
+    }
+    for (size_t g = 0; g < other.counts.size(); g++) {
+      counts[g] += other.counts[g];
+      if (other.firsts[g] >= 0 &&
+          (firsts[g] < 0 || other.firsts[g] < firsts[g])) {
+        firsts[g] = other.firsts[g];
+      }
+    }
+  }
+
+  // Appends the first and last primes and records of `other`, whose interval
+  // follows this one, including the gap between them. Histograms are merged
+  // separately by `MergeCounts`, except for that gap.
+  void AppendRecords(const GapStats& other) {
+    if (other.first < 0) {
+      return;
+    }
+    Add(other.first);
+    for (const PrimeGap& gap : other.maximal) {
+      if (maximal.empty() || gap.length > maximal.back().length) {
+        maximal.push_back(gap);
+      }
+    }
+    for (const PrimeGap& gap : other.merit) {
+      if (merit.empty() || gap.merit() > merit.back().merit()) {
+        merit.push_back(gap);
+      }
+    }
+    last = other.last;
+  }
+};
+
+// The largest distance between numbers represented by the same word of a
+// `Range`. Shorter gaps can only occur between primes in one word.
+inline const int64_t kMaxWordSpan = [] {
+  int64_t span = 0;
+  for (int64_t i = 0; i < Indexer::kBits; i += 64) {
+    span = std::max<int64_t>(
+        span, kIndexer.atIndex[i + 63] - kIndexer.atIndex[i]);
+  }
+  return span;
+}();
+
+// Adds the primes in `range` within [lo, hi] to `stats`.
+//
+// Words without primes are skipped whole. If `stats.min_gap` is above
+// `kMaxWordSpan`, only the first and last prime of each word are needed, so
+// long gaps are found without decoding every prime.
+inline void AddGaps(const Range& range, const int64_t lo, const int64_t hi,
+                    GapStats& stats) {
+  const std::vector<uint64_t> words = PrimeWords(range, lo, hi);
+  const bool inner = stats.min_gap <= kMaxWordSpan;
+  for (size_t j = 0; j < words.size(); j++) {
+    uint64_t bits = words[j];
+    if (bits == 0) {
+      continue;
+    }
+    const int64_t offset =
+        range.offset() + j / Range::kWords * Indexer::kSize;
+    const int64_t* at = &kIndexer.atIndex[j % Range::kWords * 64];
+    if (inner) {
+      for (; bits != 0; bits &= bits - 1) {
+        stats.Add(offset + at[std::countr_zero(bits)]);
+      }
+    } else {
+      stats.Add(offset + at[std::countr_zero(bits)]);
+      stats.last = offset + at[63 - std::countl_zero(bits)];
+    }
+  }
+}
+
+// Returns the statistics of gaps of at least `min_gap` between primes in
+// [lo, hi], sieving chunks in parallel on `threads` threads. `base` must hold
+// primes up to at least `sqrt(hi)`.
+//
+// Each thread keeps its own histogram. Records depend on all gaps before
+// them, so each chunk keeps its own, and these are merged in order together
+// with the gaps between chunks once all chunks are done.
+inline GapStats PrimeGaps(const BasePrimes& base, int64_t lo, const int64_t hi,
+                          const int64_t min_gap = 1, const int threads = 1) {
+  lo = std::max<int64_t>(lo, 0);
+  GapStats stats;
+  stats.min_gap = min_gap;
+  for (const int64_t p : kWheelPrimes) {
+    if (lo <= p && p <= hi) {
+      stats.Add(p);
+    }
+  }
+  const int64_t start = lo / Indexer::kSize * Indexer::kSize;
+  const int64_t chunk_count = hi >= lo ? (hi - start) / kChunkSize + 1 : 0;
+  std::vector<GapStats> counts(threads);
+  std::vector<GapStats> chunks(chunk_count);
+  ParallelForChunksBetween(
+      base, lo, hi, threads, [&](const Range& range, const int thread) {
+        GapStats& chunk = chunks[(range.offset() - start) / kChunkSize];
+        chunk.min_gap = min_gap;
+        AddGaps(range, lo, hi, chunk);
+        counts[thread].MergeCounts(chunk);
+        chunk.counts.clear();
+        chunk.firsts.clear();
+      });
+  for (const GapStats& chunk : chunks) {
+    stats.AppendRecords(chunk);
+  }
+  for (const GapStats& thread_counts : counts) {
+    stats.MergeCounts(thread_counts);
+  }
+  return stats;
+}
+
+// Returns the statistics of gaps of at least `min_gap` between primes in
+// [lo, hi] using `threads` threads.
+inline GapStats PrimeGaps(const int64_t lo, const int64_t hi,
+                          const int64_t min_gap = 1, const int threads = 1) {
+  return PrimeGaps(BasePrimes(hi), lo, hi, min_gap, threads);
+}
+
+#endif  // ZILLION_PRIMES_GAPS_H_
@@ -0,0 +1,302 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Verifies the Goldbach conjecture, that every even number `n > 2` is the sum
+// of two primes `p + q`, over intervals, finding the smallest such `p` for
+// each `n`.
+//
+// Each window of even numbers comes with a bitmap of the odd numbers from one
+// row of `Indexer::kSize` below it, marking the primes of a sieved `Range`.
+// For each word of 64 even numbers `n`, the bits of `n - p` for the small odd
+// primes `p` are read at once as a shifted word and cleared from the pending
+// ones, until none is left. Even for `n` near 2^63, the smallest `p` is rarely
+// above a few hundred.
+
+#ifndef ZILLION_PRIMES_GOLDBACH_H_
+#define ZILLION_PRIMES_GOLDBACH_H_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "primality.h"
+#include "sieve.h"
+
+// The odd primes below `Indexer::kSize`, which are tried first as the
+// smallest prime of a sum.
+inline const std::vector<int64_t> kGoldbachPrimes = [] {
+  std::vector<bool> composite(Indexer::kSize);
+  std::vector<int64_t> primes;
+  for (int64_t p = 3; p < Indexer::kSize; p += 2) {
+    if (!composite[p]) {
+      primes.push_back(p);
+      for (int64_t m = p * p; m < Indexer::kSize; m += 2 * p) {
+        composite[m] = true;
+      }
+    }
+  }
+  return primes;
+}();
+
+// Returns the smallest prime `p > after` such that `n - p` is prime too, or -1
+// if there is none. Slow, only for numbers not covered by `kGoldbachPrimes`.
+inline int64_t GoldbachPrime(const int64_t n, const int64_t after) {
+  for (int64_t p = NextPrime(after); p > 0 && p <= n / 2; p = NextPrime(p)) {
+    if (IsPrime(n - p)) {
+      return p;
+    }
+  }
+  return -1;
+}
+
+// An even number `n` whose smallest prime `p` with `n - p` prime is larger
+// than for all smaller even numbers.
+struct GoldbachRecord {
+  int64_t n;
+  int64_t p;
+};
+
+// The results of verifying an interval.
+struct GoldbachStats {
+  // The interval verified. Empty if `hi < lo`.
+  int64_t lo = 0;
+  int64_t hi = -1;
+  // `counts[p]` is the number of even numbers whose smallest prime is `p`.
+  std::vector<int64_t> counts;
+  // The records of the smallest prime, in increasing order.
+  std::vector<GoldbachRecord> records;
+  // Even numbers that aren't a sum of two primes. Hopefully always empty.
+  std::vector<int64_t> failures;
+
+  // Adds `count` even numbers with smallest prime `p` to the histogram.
+  void Count(const int64_t p, const int64_t count = 1) {
+    if (std::ssize(counts) <= p) {
+      counts.resize(p + 1);
+    }
+    counts[p] += count;
+  }
+
+  // Adds `n` with smallest prime `p` to the records.
+  void Record(const int64_t n, const int64_t p) {
+    if (records.empty() || p > records.back().p) {
+      records.push_back({n, p});
+    }
+  }
+
+  // Appends `other`, whose interval follows this one.
+  void Append(const GoldbachStats& other) {
+    if (other.hi < other.lo) {
+      return;
+    }
+    if (hi < lo) {
+      lo = other.lo;
+    }
+    hi = other.hi;
+    for (size_t p = 0; p < other.counts.size(); p++) {
+      if (other.counts[p] > 0) {
+        Count(p, other.counts[p]);
+      }
+    }
+    for (const GoldbachRecord& record : other.records) {
+      Record(record.n, record.p);
+    }
+    failures.insert(failures.end(), other.failures.begin(),
+                    other.failures.end());
+  }
+};
+
+// Writes `stats` as text lines: `goldbach LO HI`, then `count P C` for each
+// smallest prime, `record N P` for each record and `failure N` for each
+// failure.
+inline void WriteGoldbachStats(std::ostream& out, const GoldbachStats& stats) {
+  out << "goldbach " << stats.lo << ' ' << stats.hi << '\n';
+  for (size_t p = 0; p < stats.counts.size(); p++) {
+    if (stats.counts[p] > 0) {
+      out << "count " << p << ' ' << stats.counts[p] << '\n';
+    }
+  }
+  for (const GoldbachRecord& record : stats.records) {
+    out << "record " << record.n << ' ' << record.p << '\n';
+  }
+  for (const int64_t n : stats.failures) {
+    out << "failure " << n << '\n';
+  }
+}
+
+// Reads `stats` written by `WriteGoldbachStats`. Returns false if the input is
+// malformed.
+inline bool ReadGoldbachStats(std::istream& in, GoldbachStats& stats) {
+  stats = GoldbachStats();
+  std::string key;
+  if (!(in >> key >> stats.lo >> stats.hi) || key != "goldbach") {
+    return false;
+  }
+  while (in >> key) {
+    int64_t a = 0;
+    int64_t b = 0;
+    if (key == "count" && in >> a >> b && a >= 0 && b > 0) {
+      stats.Count(a, b);
+    } else if (key == "record" && in >> a >> b) {
+      stats.records.push_back({a, b});
+    } else if (key == "failure" && in >> a) {
+      stats.failures.push_back(a);
+    } else {
+      return false;
+    }
+  }
+  return in.eof();
+}
+
+// Verifies the even numbers in [lo, hi] into `stats`, using `base` to sieve
+// primes from `offset` on. `offset` must be a multiple of `Indexer::kSize`,
+// and either 0 or at most `lo - Indexer::kSize`.
+inline void VerifyGoldbachWindow(const BasePrimes& base, const int64_t offset,
+                                 const int64_t lo, const int64_t hi,
+                                 GoldbachStats& stats) {
+  stats.lo = lo;
+  stats.hi = hi;
+  if (lo <= 4 && 4 <= hi) {
+    stats.Count(2);
+    stats.Record(4, 2);
+  }
+  const int64_t first = std::max<int64_t>(lo + (lo & 1), 6);
+  if (first > hi) {
+    return;
+  }
+  Range range(offset, (hi - offset) / Indexer::kSize + 1);
+  base.Sieve(range);
+  // Bit `i` of `odd` is set if `offset + 1 + 2 i` is prime. Two more words let
+  // any 64 bits up to the end of the range be read at once.
+  std::vector<uint64_t> odd(range.size() / 128 + 2);
+  auto mark = [&odd](const int64_t x) {
+    odd[x / 128] |= uint64_t{1} << (x / 2 % 64);
+  };
+  range.ForPrimes(mark);
+  if (offset == 0) {
+    for (const int64_t p : kWheelPrimes) {
+      if (p != 2) {
+        mark(p);
+      }
+    }
+  }
+  // Returns bits `t` to `t + 63` of `odd`, which are 0 below bit 0.
+  auto bits_at = [&odd](const int64_t t) -> uint64_t {
+    if (t < 0) {
+      return t > -64 ? odd[0] << -t : 0;
+    }
+    const int64_t j = t / 64;
+    const int shift = t % 64;
+    return shift == 0 ? odd[j] : odd[j] >> shift | odd[j + 1] << (64 - shift);
+  };
+  const std::vector<int64_t>& primes = kGoldbachPrimes;
+  std::vector<int64_t> counts(primes.size());
+  int64_t record = stats.records.empty() ? 0 : stats.records.back().p;
+  for (int64_t n0 = first; n0 <= hi; n0 += 128) {
+    const int64_t evens = std::min<int64_t>((hi - n0) / 2 + 1, 64);
+    // `n0 - p` is bit `t0 - p / 2` of `odd`.
+    const int64_t t0 = (n0 - offset - 2) / 2;
+    uint64_t pending =
+        evens == 64 ? ~uint64_t{0} : (uint64_t{1} << evens) - 1;
+    size_t last = 0;
+    for (size_t i = 0; pending != 0 && i < primes.size(); i++) {
+      if (const uint64_t hits = pending & bits_at(t0 - primes[i] / 2);
+          hits != 0) {
+        counts[i] += std::popcount(hits);
+        pending &= ~hits;
+        last = i;
+      }
+    }
+    if (pending == 0 && primes[last] <= record) {
+      continue;
+    }
+    // A new record or numbers not covered by `primes`: go through the numbers
+    // one by one, in order.
+    for (int b = 0; b < evens; b++) {
+      const int64_t n = n0 + 2 * b;
+      int64_t p = -1;
+      if (pending >> b & 1) {
+        p = GoldbachPrime(n, primes.back());
+        if (p < 0) {
+          stats.failures.push_back(n);
+          continue;
+        }
+        stats.Count(p);
+      } else {
+        for (size_t j = 0; p < 0; j++) {
+          if (bits_at(t0 + b - primes[j] / 2) & 1) {
+            p = primes[j];
+          }
+        }
+      }
+      if (p > record) {
+        stats.Record(n, p);
+        record = p;
+      }
+    }
+  }
+  for (size_t i = 0; i < primes.size(); i++) {
+    if (counts[i] > 0) {
+      stats.Count(primes[i], counts[i]);
+    }
+  }
+}
+
+// The most numbers in a window of `ForGoldbachWindows`.
+inline constexpr int64_t kGoldbachWindowSize = 2 * kChunkSize;
+
+// Calls `f` with the `GoldbachStats` of consecutive windows covering [lo, hi]
+// in increasing order, verifying windows in parallel on `threads` threads.
+// `base` must hold primes up to at least `sqrt(hi)`. Once `f` has been called
+// for a window, all even numbers up to its end have been verified, so the
+// appended stats can be saved and verification resumed after it.
+template <typename F>
+void ForGoldbachWindows(const BasePrimes& base, int64_t lo, const int64_t hi,
+                        const int threads, F&& f) {
+  lo = std::max<int64_t>(lo, 0);
+  const int64_t start = lo / Indexer::kSize * Indexer::kSize;
+  ForWindowsInOrder<GoldbachStats>(
+      start, hi, kGoldbachWindowSize, threads,
+      [&base, lo](const int64_t window_lo, const int64_t window_hi,
+                  std::vector<GoldbachStats>& out) {
+        out.emplace_back();
+        VerifyGoldbachWindow(
+            base, std::max<int64_t>(window_lo - Indexer::kSize, 0),
+            std::max(window_lo, lo), window_hi, out.back());
+      },
+      [&f](const std::span<const GoldbachStats> windows) {
+        for (const GoldbachStats& window : windows) {
+          f(window);
+        }
+      });
+}
+
+// Returns the results of verifying all even numbers in [lo, hi] using
+// `threads` threads.
+inline GoldbachStats VerifyGoldbach(const int64_t lo, const int64_t hi,
+                                    const int threads = 1) {
+  GoldbachStats stats;
+  ForGoldbachWindows(BasePrimes(hi), lo, hi, threads,
+                     [&stats](const GoldbachStats& window) {
+                       stats.Append(window);
+                     });
+  return stats;
+}
+
+#endif  // ZILLION_PRIMES_GOLDBACH_H_
@@ -0,0 +1,352 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sinks that receive primes and write them out as 64-bit little-endian
+// numbers.
+
+#ifndef ZILLION_PRIMES_OUTPUT_H_
+#define ZILLION_PRIMES_OUTPUT_H_
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "stats.h"
+
+// Stores `p` as a 64-bit little-endian number into `out[0..7]`.
+inline void EncodeLittleEndian(int64_t p, char* out) {
+  for (size_t i = 0; i < 8; i++) {
+    out[i] = p & 0xff;
+    p >>= 8;
+  }
+}
+
+// Prints `what` together with `errno` and terminates the program.
+[[noreturn]] inline void Fail(const char* what) {
+  std::perror(what);
+  std::exit(1);
+}
+
+// Outputs primes to stdout.
+class StdoutSink {
+ public:
+  void Put(int64_t p) {
+    char out[8];
+    EncodeLittleEndian(p, out);
+    fwrite(&out, sizeof(out), 1, stdout);
+    Stats::AddOutput(1, sizeof(out));
+  }
+  void Put(const std::span<const uint64_t> primes) {
+    const ScopedPhase phase(Phase::kWrite);
+    Stats::AddOutput(primes.size(), 8 * primes.size());
+    buffer_.resize(8 * primes.size());
+    for (size_t i = 0; i < primes.size(); i++) {
+      EncodeLittleEndian(primes[i], &buffer_[8 * i]);
+    }
+    fwrite(buffer_.data(), 1, buffer_.size(), stdout);
+  }
+
+ private:
+  std::vector<char> buffer_;
+};
+
+// Outputs primes to a file using io_uring.
+//
+// Primes are encoded into one of `buffer_count` registered buffers. Once a
+// buffer is full, it's submitted as a single `IORING_OP_WRITE_FIXED` request
+// and encoding continues into the next free buffer right away. `Put` only
+// blocks when all buffers are in flight, that is, when the disk can't keep up
+// with the sieve.
+//
+// With `direct`, the file is opened with `O_DIRECT`, which bypasses the page
+// cache. All writes are then padded to `kAlignment` and the file is truncated
+// to its real size at the end.
+//
+// Where io_uring isn't available, for example because the kernel lacks it or
+// it's disabled, a single buffer is written with plain `write` calls instead,
+// which block while the disk is busy.
+class UringSink {
+ public:
+  static constexpr size_t kAlignment = 4096;
+
+  UringSink(const char* path, bool direct, size_t buffer_size = 4 << 20,
+            unsigned buffer_count = 8)
+      : buffer_size_(buffer_size),
+        buffers_(buffer_count),
+        pending_(buffer_count),
+        direct_(direct) {
+    fd_ = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0),
+               0644);
+    if (fd_ < 0) {
+      Fail(path);
+    }
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd_ = syscall(__NR_io_uring_setup, buffer_count, &params);
+    if (ring_fd_ < 0) {
+      buffer_count = 1;
+      buffers_.resize(buffer_count);
+    } else {
+      MapRings(params);
+    }
+    std::vector<iovec> iovecs(buffer_count);
+    for (unsigned i = 0; i < buffer_count; i++) {
+      buffers_[i] = static_cast<char*>(aligned_alloc(kAlignment, buffer_size));
+      if (buffers_[i] == nullptr) {
+        Fail("aligned_alloc");
+      }
+      iovecs[i] = {buffers_[i], buffer_size};
+      free_.push_back(i);
+    }
+    if (ring_fd_ >= 0 &&
+        syscall(__NR_io_uring_register, ring_fd_, IORING_REGISTER_BUFFERS,
+                iovecs.data(), buffer_count) < 0) {
+      Fail("io_uring_register");
+    }
+    NextBuffer();
+  }
+  UringSink(const UringSink&) = delete;
+  UringSink& operator=(const UringSink&) = delete;
+
+  ~UringSink() {
+    const uint64_t size = position_ + fill_;
+    if (fill_ > 0) {
+      size_t length = fill_;
+      if (direct_) {
+        length = (length + kAlignment - 1) / kAlignment * kAlignment;
+        memset(buffers_[current_] + fill_, 0, length - fill_);
+      }
+      Submit(length);
+    }
+    while (in_flight_ > 0) {
+      Reap(1);
+    }
+    if (direct_ && ftruncate(fd_, size) < 0) {
+      Fail("ftruncate");
+    }
+    close(fd_);
+    if (ring_fd_ >= 0) {
+      close(ring_fd_);
+      munmap(sqes_, sqes_size_);
+      munmap(sq_ring_, sq_ring_size_);
+      if (cq_ring_ != sq_ring_) {
+        munmap(cq_ring_, cq_ring_size_);
+      }
+    }
+    for (char* buffer : buffers_) {
+      free(buffer);
+    }
+  }
+
+  void Put(int64_t p) {
+    if (fill_ == buffer_size_) {
+      Submit(fill_);
+      NextBuffer();
+    }
+    EncodeLittleEndian(p, buffers_[current_] + fill_);
+    fill_ += 8;
+    Stats::AddOutput(1, 8);
+  }
+  void Put(std::span<const uint64_t> primes) {
+    const ScopedPhase phase(Phase::kWrite);
+    Stats::AddOutput(primes.size(), 8 * primes.size());
+    while (!primes.empty()) {
+      if (fill_ == buffer_size_) {
+        Submit(fill_);
+        NextBuffer();
+      }
+      const size_t count = std::min(primes.size(), (buffer_size_ - fill_) / 8);
+      char* out = buffers_[current_] + fill_;
+      for (size_t i = 0; i < count; i++) {
+        EncodeLittleEndian(primes[i], out + 8 * i);
+      }
+      fill_ += 8 * count;
+      primes = primes.subspan(count);
+    }
+  }
+
+ private:
+  void MapRings(const io_uring_params& params) {
+    sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_ring_size_ =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single_mmap && cq_ring_size_ > sq_ring_size_) {
+      sq_ring_size_ = cq_ring_size_;
+    }
+    sq_ring_ = static_cast<char*>(
+        mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING));
+    if (sq_ring_ == MAP_FAILED) {
+      Fail("mmap");
+    }
+    if (single_mmap) {
+      cq_ring_ = sq_ring_;
+    } else {
+      cq_ring_ = static_cast<char*>(
+          mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING));
+      if (cq_ring_ == MAP_FAILED) {
+        Fail("mmap");
+      }
+    }
+    sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe*>(
+        mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES));
+    if (sqes_ == MAP_FAILED) {
+      Fail("mmap");
+    }
+    sq_tail_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned*>(sq_ring_ + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq_ring_ + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ring_ + params.cq_off.cqes);
+  }
+
+  // Makes a free buffer current, waiting for a write to complete if needed.
+  void NextBuffer() {
+    while (free_.empty()) {
+      Reap(1);
+    }
+    current_ = free_.back();
+    free_.pop_back();
+    fill_ = 0;
+  }
+
+  // Submits the first `length` bytes of the current buffer to be written at
+  // `position_`, or writes them right away without io_uring.
+  void Submit(size_t length) {
+    if (ring_fd_ < 0) {
+      Write(buffers_[current_], length);
+      free_.push_back(current_);
+    } else {
+      Enqueue(current_, 0, length, position_);
+    }
+    position_ += fill_;
+  }
+
+  // Writes `data[0..length)` at the end of the file, retrying short writes.
+  void Write(const char* data, size_t length) {
+    while (length > 0) {
+      const ssize_t written = write(fd_, data, length);
+      if (written < 0) {
+        Fail("write");
+      }
+      data += written;
+      length -= written;
+    }
+  }
+
+  // Submits a write of `buffers_[index][start..start+length)` at `offset`.
+  void Enqueue(unsigned index, size_t start, size_t length, uint64_t offset) {
+    const unsigned tail = *sq_tail_;
+    io_uring_sqe& sqe = sqes_[tail & sq_mask_];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_WRITE_FIXED;
+    sqe.fd = fd_;
+    sqe.addr = reinterpret_cast<uint64_t>(buffers_[index] + start);
+    sqe.len = length;
+    sqe.off = offset;
+    sqe.buf_index = index;
+    sqe.user_data = index;
+    sq_array_[tail & sq_mask_] = tail & sq_mask_;
+    __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    pending_[index] = {start, length, offset};
+    in_flight_++;
+    if (syscall(__NR_io_uring_enter, ring_fd_, 1, 0, 0, nullptr, 0) < 0) {
+      Fail("io_uring_enter");
+    }
+  }
+
+  // Waits for at least `count` completions and returns their buffers to the
+  // free list. Short writes are resubmitted.
+  void Reap(unsigned count) {
+    if (syscall(__NR_io_uring_enter, ring_fd_, 0, count,
+                IORING_ENTER_GETEVENTS, nullptr, 0) < 0) {
+      Fail("io_uring_enter");
+    }
+    unsigned head = *cq_head_;
+    const unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+      const unsigned index = cqe.user_data;
+      in_flight_--;
+      if (cqe.res < 0) {
+        errno = -cqe.res;
+        Fail("write");
+      }
+      const Pending& pending = pending_[index];
+      if (static_cast<size_t>(cqe.res) < pending.length) {
+        __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+        Enqueue(index, pending.start + cqe.res, pending.length - cqe.res,
+                pending.offset + cqe.res);
+        continue;
+      }
+      free_.push_back(index);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+
+  // Describes a write that was submitted, but hasn't completed yet.
+  struct Pending {
+    size_t start;
+    size_t length;
+    uint64_t offset;
+  };
+
+  const size_t buffer_size_;
+  std::vector<char*> buffers_;
+  std::vector<Pending> pending_;
+  std::vector<unsigned> free_;
+  unsigned current_;
+  size_t fill_;
+  // File position of the current buffer.
+  uint64_t position_ = 0;
+  unsigned in_flight_ = 0;
+  const bool direct_;
+
+  int fd_;
+  // -1 without io_uring.
+  int ring_fd_;
+  char* sq_ring_;
+  size_t sq_ring_size_;
+  char* cq_ring_;
+  size_t cq_ring_size_;
+  io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_tail_;
+  unsigned sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned cq_mask_;
+  io_uring_cqe* cqes_;
+};
+
+#endif  // ZILLION_PRIMES_OUTPUT_H_
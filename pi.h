@@ -0,0 +1,417 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Computes the prime-counting function pi(x) without sieving all numbers up to
+// x, using the Lagarias-Miller-Odlyzko algorithm in O(x^(2/3)) time.
+//
+// With `y >= cbrt(x)` and `a = pi(y)`:
+//
+//   pi(x) = phi(x, a) + a - 1 - P2(x, a)
+//
+// where `phi(x, a)` counts numbers <= x not divisible by any of the first `a`
+// primes and `P2(x, a)` counts numbers <= x with exactly two prime factors,
+// both > y. `phi(x, a)` is expanded into ordinary leaves `mu(n) phi(x/n, c)`
+// with `n <= y`, computed directly using the `Indexer` wheel for `c = 6`, and
+// special leaves `phi(x / (p_b m), b - 1)` with `x / (p_b m) < x / y`, which
+// are counted in `Range`-s sieved segment by segment.
+
+#ifndef ZILLION_PRIMES_PI_H_
+#define ZILLION_PRIMES_PI_H_
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <vector>
+
+#include "sieve.h"
+
+// For each `r` in [0, Indexer::kSize], the number of residues below `r` not
+// divisible by any of `kWheelPrimes`, that is, of indices in
+// `kIndexer.atIndex` less than `r`.
+inline constexpr struct WheelCounts {
+  constexpr WheelCounts() : below() {
+    for (ptrdiff_t r = 0; r < Indexer::kSize; r++) {
+      below[r + 1] = below[r] + (kIndexer.indexOf[r] >= 0);
+    }
+  }
+
+  int32_t below[Indexer::kSize + 1];
+} kWheelCounts;
+
+// Returns `phi(x, 6)`, the number of integers in [1, x] not divisible by any
+// of `kWheelPrimes`.
+constexpr int64_t WheelPhi(const int64_t x) {
+  return x / Indexer::kSize * Indexer::kBits +
+         kWheelCounts.below[x % Indexer::kSize + 1];
+}
+
+// Returns `floor(sqrt(x))`.
+inline int64_t IntegerSqrt(const int64_t x) {
+  int64_t r = std::sqrt(static_cast<long double>(x));
+  while (r * r > x) {
+    r--;
+  }
+  while ((r + 1) * (r + 1) <= x) {
+    r++;
+  }
+  return r;
+}
+
+// Returns `floor(cbrt(x))`.
+inline int64_t IntegerCbrt(const int64_t x) {
+  int64_t r = std::cbrt(static_cast<long double>(x));
+  while (r * r * r > x) {
+    r--;
+  }
+  while ((r + 1) * (r + 1) * (r + 1) <= x) {
+    r++;
+  }
+  return r;
+}
+
+// Counts numbers marked as primes in a `Range` up to increasing offsets.
+class RangeCounter {
+ public:
+  explicit RangeCounter(const Range& range)
+      : words_(range.words().data()) {}
+
+  // Returns the number of numbers marked as primes in the range in
+  // `[offset(), offset() + r]`. `r` must not decrease between calls.
+  int64_t CountUpTo(const int64_t r) {
+    const int64_t position = r / Indexer::kSize * Indexer::kBits +
+                             kWheelCounts.below[r % Indexer::kSize + 1];
+    for (; word_ < position / 64; word_++) {
+      count_ += std::popcount(~words_[word_]);
+    }
+    const uint64_t mask = (uint64_t{1} << (position % 64)) - 1;
+    return mask == 0 ? count_ : count_ + std::popcount(~words_[word_] & mask);
+  }
+
+ private:
+  const uint64_t* const words_;
+  int64_t word_ = 0;
+  int64_t count_ = 0;
+};
+
+// Returns `x / (a * b)`, or 0 if `a * b` doesn't fit into `int64_t`.
+inline int64_t DivideByProduct(const int64_t x, const int64_t a,
+                               const int64_t b) {
+  const __int128 product = static_cast<__int128>(a) * b;
+  return product > x ? 0 : x / static_cast<int64_t>(product);
+}
+
+// The numbers up to `y` needed by the leaves of the LMO algorithm.
+struct LeafTables {
+  explicit LeafTables(const int64_t y)
+      : least_factor(y + 1), mobius(y + 1, 1), primes(1, 0) {
+    least_factor[1] = INT32_MAX;
+    for (int64_t n = 2; n <= y; n++) {
+      if (least_factor[n] == 0) {
+        primes.push_back(n);
+        for (int64_t m = n; m <= y; m += n) {
+          if (least_factor[m] == 0) {
+            least_factor[m] = n;
+          }
+        }
+      }
+      const int64_t rest = n / least_factor[n];
+      mobius[n] = rest % least_factor[n] == 0 ? 0 : -mobius[rest];
+    }
+  }
+
+  // The least prime factor of each number, and "infinity" for 1.
+  std::vector<int32_t> least_factor;
+  // The Moebius function of each number.
+  std::vector<int8_t> mobius;
+  // Primes up to `y` indexed from 1, that is `primes[1] == 2`.
+  std::vector<int64_t> primes;
+};
+
+// The index `c` of the last prime sieved out by the `Indexer` wheel, that is
+// `primes[c] == 13`.
+constexpr int64_t kWheelIndex = 6;
+
+// Returns the sum of the special leaves `-mu(m) phi(x / (p_b m), b - 1)` over
+// `b > kWheelIndex`, `m <= y < p_b m` and `lpf(m) > p_b`, sieving [0, x / y]
+// in segments on `threads` threads.
+//
+// Every block of consecutive segments is processed independently, counting
+// `phi` only relative to the start of the block. For each `b`, it also records
+// the sum of the signs of its leaves and how many numbers not divisible by the
+// first `b - 1` primes it holds. Then blocks are combined in order, adding the
+// count before the block times the sum of the signs for each `b`.
+inline __int128 SpecialLeaves(const int64_t x, const int64_t y,
+                              const LeafTables& tables, const int threads) {
+  const std::vector<int64_t>& primes = tables.primes;
+  const int64_t pi_y = primes.size() - 1;
+  const int64_t z = x / y;
+  constexpr int64_t kSegmentSize = kChunkSize;
+  const int64_t segment_count = z / kSegmentSize + 1;
+  const int64_t block_count =
+      std::min<int64_t>(segment_count, 16 * static_cast<int64_t>(threads));
+  struct Block {
+    __int128 sum = 0;
+    std::vector<int64_t> signs;
+    std::vector<int64_t> counts;
+  };
+  std::vector<Block> blocks(block_count);
+  ParallelFor(threads, block_count, [&](const int64_t index) {
+    Block& block = blocks[index];
+    for (int64_t segment = segment_count * index / block_count;
+         segment < segment_count * (index + 1) / block_count; segment++) {
+      const int64_t low = segment * kSegmentSize;
+      const int64_t high = std::min(low + kSegmentSize, z + 1);
+      Range range(low, (high - low + Indexer::kSize - 1) / Indexer::kSize);
+      // `Range` doesn't represent 1, but `phi` counts it.
+      const int64_t one = low == 0;
+      for (int64_t b = kWheelIndex + 1; b < pi_y; b++) {
+        const int64_t p = primes[b];
+        if (p * p > y && DivideByProduct(x, p, p) < low) {
+          break;  // No more leaves in this and all later segments.
+        }
+        if (b >= static_cast<int64_t>(block.signs.size())) {
+          block.signs.resize(b + 1);
+          block.counts.resize(b + 1);
+        }
+        // Leaves `x / (p m)` in [low, high) in increasing order.
+        const int64_t m_max =
+            std::min(y, low == 0 ? y : DivideByProduct(x, p, low));
+        const int64_t m_min = std::max(y / p, DivideByProduct(x, p, high));
+        RangeCounter counter(range);
+        const int64_t before = block.counts[b];
+        int64_t sign_sum = 0;
+        __int128 sum = 0;
+        if (p * p > y) {
+          // Only primes `m > p` qualify.
+          auto q = std::upper_bound(primes.begin(), primes.end(), m_max);
+          const auto q_min = std::upper_bound(primes.begin(), primes.end(),
+                                              std::max(m_min, p));
+          for (; q-- > q_min;) {
+            sign_sum++;
+            sum += before + one + counter.CountUpTo(x / (p * *q) - low);
+          }
+        } else {
+          for (int64_t m = m_max; m > m_min; m--) {
+            if (tables.mobius[m] != 0 && tables.least_factor[m] > p) {
+              const int64_t count =
+                  before + one + counter.CountUpTo(x / (p * m) - low);
+              sign_sum -= tables.mobius[m];
+              sum -= tables.mobius[m] * count;
+            }
+          }
+        }
+        block.signs[b] += sign_sum;
+        block.sum += sum;
+        block.counts[b] += one + counter.CountUpTo(range.size() - 1);
+        range.Sieve(p, MinusMod(low, p));
+      }
+    }
+  });
+  __int128 sum = 0;
+  std::vector<int64_t> counts(pi_y + 1);
+  for (const Block& block : blocks) {
+    sum += block.sum;
+    for (size_t b = 0; b < block.signs.size(); b++) {
+      sum += static_cast<__int128>(block.signs[b]) * counts[b];
+      counts[b] += block.counts[b];
+    }
+  }
+  return sum;
+}
+
+// Returns `P2(x, y)`, the number of integers <= x with exactly two prime
+// factors, both > y, using `threads` threads.
+//
+// That is the sum of `pi(x / p) - pi(p) + 1` over primes `y < p <= sqrt(x)`.
+// Chunks of [0, x / y] are sieved in parallel, each counting its primes and
+// the primes up to `x / p` for all `p` with `x / p` inside it. The counts are
+// then combined in order.
+inline int64_t P2(const int64_t x, const int64_t y, const int threads) {
+  const int64_t sqrt_x = IntegerSqrt(x);
+  if (sqrt_x <= y) {
+    return 0;
+  }
+  const int64_t z = x / (y + 1);
+  const BasePrimes base(z);
+  struct Chunk {
+    // The number of primes in the chunk.
+    int64_t count = 0;
+    // The number of `p` with `x / p` in the chunk, and the sum of the number
+    // of primes in the chunk up to `x / p` for them.
+    int64_t leaves = 0;
+    int64_t sum = 0;
+  };
+  const int64_t chunk_count = z / kChunkSize + 1;
+  std::vector<Chunk> chunks(chunk_count);
+  ParallelFor(threads, chunk_count, [&](const int64_t index) {
+    const int64_t low = index * kChunkSize;
+    const Range range =
+        SieveChunk(base, 0, index,
+                   std::min<int64_t>(kChunkLength,
+                                     (z - low) / Indexer::kSize + 1));
+    const int64_t high = low + range.size();
+    Chunk& chunk = chunks[index];
+    chunk.count = range.Count();
+    std::vector<int64_t> ps;
+    ForPrimesBetween(base, std::max(y, x / high) + 1,
+                     low == 0 ? sqrt_x : std::min(sqrt_x, x / low),
+                     [&ps](const int64_t p) { ps.push_back(p); });
+    RangeCounter counter(range);
+    for (auto p = ps.rbegin(); p != ps.rend(); p++) {
+      chunk.leaves++;
+      chunk.sum += counter.CountUpTo(x / *p - low);
+    }
+  });
+  int64_t sum = 0;
+  // Primes below `Indexer::kNextPrime` aren't represented by ranges.
+  int64_t pi = std::size(kWheelPrimes);
+  for (const Chunk& chunk : chunks) {
+    sum += chunk.sum + chunk.leaves * pi;
+    pi += chunk.count;
+  }
+  // Subtract `pi(p) - 1` for all `p`, that is all integers from `pi(y)` to
+  // `pi(sqrt(x)) - 1`.
+  const int64_t a = CountPrimes(base, 0, y);
+  const int64_t b = CountPrimes(base, 0, sqrt_x);
+  return sum - (b - a) * (a + b - 1) / 2;
+}
+
+// Returns the number of primes <= x, using `threads` threads.
+inline int64_t PrimePi(const int64_t x, const int threads = 1) {
+  if (x < 100000000) {
+    return CountPrimes(0, x, threads);
+  }
+  // Larger `y` means less sieving, but more special leaves. The factor was
+  // tuned empirically to balance the two.
+  const double log_x = std::log(static_cast<double>(x));
+  const double alpha = std::max(1.0, log_x * log_x * log_x / 8000);
+  const int64_t y = std::min<int64_t>(alpha * IntegerCbrt(x), 1 << 25);
+  const LeafTables tables(y);
+  const int64_t pi_y = tables.primes.size() - 1;
+  // Ordinary leaves `mu(n) phi(x / n, 6)` for `n <= y` with `lpf(n) > 13`.
+  __int128 phi = 0;
+  for (int64_t n = 1; n <= y; n++) {
+    if (tables.mobius[n] != 0 &&
+        tables.least_factor[n] > tables.primes[kWheelIndex]) {
+      phi += tables.mobius[n] * WheelPhi(x / n);
+    }
+  }
+  phi += SpecialLeaves(x, y, tables, threads);
+  return static_cast<int64_t>(phi + pi_y - 1 - P2(x, y, threads));
+}
+
+// Returns the logarithmic integral `li(x)` for `x > 1`, using Ramanujan's
+// series.
+inline long double LogarithmicIntegral(const long double x) {
+  constexpr long double kEulerGamma = 0.577215664901532860606512090082L;
+  const long double log_x = std::log(x);
+  long double sum = 0;
+  long double inner = 0;
+  long double term = -2;  // (-1)^(n-1) log(x)^n / (n! 2^(n-1))
+  for (int n = 1; n < 1000; n++) {
+    term *= -log_x / (2 * n);
+    if (n % 2 == 1) {
+      inner += 1.0L / n;
+    }
+    const long double previous = sum;
+    sum += term * inner;
+    if (sum == previous) {
+      break;
+    }
+  }
+  return kEulerGamma + std::log(log_x) + std::sqrt(x) * sum;
+}
+
+// The number of primes up to 2^63 - 1, and so the largest `n` for which the
+// `n`-th prime fits into `int64_t`.
+inline constexpr int64_t kMaxNthPrime = 216289611853439384;
+
+// Returns an estimate of the `n`-th prime as `li^-1(n)`, computed by Newton's
+// method, but at most 2^63 - 1.
+inline int64_t NthPrimeEstimate(const int64_t n) {
+  if (n < 3) {
+    return n + 1;
+  }
+  long double x = n * std::log(static_cast<long double>(n));
+  for (int i = 0; i < 100; i++) {
+    const long double next = x - (LogarithmicIntegral(x) - n) * std::log(x);
+    if (std::abs(next - x) < 0.5L) {
+      break;
+    }
+    x = next;
+  }
+  // 2^63 is exact as a `long double`, unlike 2^63 - 1.
+  return x < 0x1p63L ? static_cast<int64_t>(x)
+                     : std::numeric_limits<int64_t>::max();
+}
+
+// Returns the `n`-th prime, counting from 1, using `threads` threads. `n` must
+// be in [1, kMaxNthPrime].
+//
+// Instead of generating all primes before it, computes `pi` of an estimate by
+// `PrimePi` and then counts primes in growing windows from the estimate
+// towards the `n`-th prime.
+inline int64_t NthPrime(const int64_t n, const int threads = 1) {
+  assert(n >= 1 && n <= kMaxNthPrime);
+  if (n <= static_cast<int64_t>(std::size(kWheelPrimes))) {
+    return kWheelPrimes[n - 1];
+  }
+  const int64_t estimate = NthPrimeEstimate(n);
+  const int64_t count = PrimePi(estimate, threads);
+  constexpr int64_t kMax = std::numeric_limits<int64_t>::max();
+  const BasePrimes base(estimate <= kMax / 2 ? 2 * estimate : kMax);
+  // The window size. The error of the estimate is around `sqrt(estimate)`.
+  int64_t window = std::max<int64_t>(kChunkSize, IntegerSqrt(estimate));
+  // Returns the `k`-th prime in [lo, hi], counting from 1.
+  auto kth = [&base](const int64_t lo, const int64_t hi, int64_t k) {
+    int64_t result = 0;
+    ForPrimesBetween(base, lo, hi, [&k, &result](const int64_t p) {
+      if (--k == 0) {
+        result = p;
+      }
+    });
+    return result;
+  };
+  if (count < n) {
+    // The `k`-th prime above `estimate`.
+    int64_t k = n - count;
+    for (int64_t lo = estimate + 1;; lo += window, window *= 2) {
+      // The `n`-th prime is at most 2^63 - 1, so the loop stops at the latest
+      // with the window clamped to it.
+      const int64_t hi = window - 1 < kMax - lo ? lo + window - 1 : kMax;
+      const int64_t c = CountPrimes(base, lo, hi, threads);
+      if (c >= k) {
+        return kth(lo, hi, k);
+      }
+      k -= c;
+    }
+  }
+  // The `k`-th prime counting down from `estimate`.
+  int64_t k = count - n + 1;
+  for (int64_t hi = estimate;; hi -= window, window *= 2) {
+    const int64_t lo = std::max<int64_t>(hi - window + 1, 0);
+    const int64_t c = CountPrimes(base, lo, hi, threads);
+    if (c >= k) {
+      return kth(lo, hi, c - k + 1);
+    }
+    k -= c;
+  }
+}
+
+#endif  // ZILLION_PRIMES_PI_H_
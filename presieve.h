@@ -0,0 +1,211 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sieves windows of consecutive numbers starting at a number of any size, such
+// as a random 2048-bit one, by all primes up to a bound, leaving candidates
+// for expensive primality tests.
+//
+// The residue of the start modulo each base prime is computed once, limb by
+// limb without any division, see `BigNumberResidues`. From then on, the
+// window is just a 64-bit interval: it's sieved chunk by chunk as a `Range`
+// relative to a multiple of `Indexer::kSize` below the start, so that the
+// wheel removes multiples of `kWheelPrimes` and only the other base primes
+// are sieved, each at a cost of a division per chunk.
+
+#ifndef ZILLION_PRIMES_PRESIEVE_H_
+#define ZILLION_PRIMES_PRESIEVE_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <span>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "primality.h"
+#include "sieve.h"
+
+// A non-negative number of any size, as 64-bit limbs, least significant
+// first.
+using BigNumber = std::vector<uint64_t>;
+
+// Parses decimal `text`, or hexadecimal with a `0x` prefix, into `number`.
+// Returns false if it's malformed.
+inline bool ParseBigNumber(const std::string_view text, BigNumber& number) {
+  const bool hex = text.starts_with("0x");
+  const std::string_view digits = hex ? text.substr(2) : text;
+  number.clear();
+  if (digits.empty()) {
+    return false;
+  }
+  const uint64_t base = hex ? 16 : 10;
+  for (const char c : digits) {
+    const char lower = c | 0x20;
+    uint64_t carry = '0' <= c && c <= '9'       ? c - '0'
+                     : 'a' <= lower && lower <= 'f' ? lower - 'a' + 10
+                                                    : base;
+    if (carry >= base) {
+      return false;
+    }
+    for (uint64_t& limb : number) {
+      const uint128_t t = static_cast<uint128_t>(limb) * base + carry;
+      limb = static_cast<uint64_t>(t);
+      carry = t >> 64;
+    }
+    if (carry != 0) {
+      number.push_back(carry);
+    }
+  }
+  return true;
+}
+
+// Returns whether `x > y`.
+inline bool BigNumberAbove(const BigNumber& x, const uint64_t y) {
+  return x.size() > 1 || (x.size() == 1 && x[0] > y);
+}
+
+// Returns `x mod m` for `m > 0`, dividing limb by limb.
+inline int64_t BigNumberMod(const BigNumber& x, const int64_t m) {
+  uint64_t r = 0;
+  for (auto limb = x.rbegin(); limb != x.rend(); ++limb) {
+    r = ((static_cast<uint128_t>(r) << 64) | *limb) % m;
+  }
+  return r;
+}
+
+// Sets `residues[i]` to `x mod primes[i]` for odd `primes`.
+//
+// For each prime `n`, keeps `y 2^-64 mod n` for the number `y` of the limbs
+// so far, so that appending a limb is a single Montgomery reduction of
+// `y 2^-64 2^128 + limb`. As in `MillerRabin`, `kPrimalityLanes` primes go
+// through the limbs together, overlapping their chains of multiplications.
+inline void BigNumberResidues(const BigNumber& x,
+                              const std::span<const uint32_t> primes,
+                              const std::span<uint32_t> residues) {
+  for (size_t i = 0; i < primes.size(); i += kPrimalityLanes) {
+    Montgomery montgomery[kPrimalityLanes];
+    uint64_t r[kPrimalityLanes] = {};
+    const size_t count = std::min(kPrimalityLanes, primes.size() - i);
+    for (size_t j = 0; j < count; j++) {
+      montgomery[j] = Montgomery(primes[i + j]);
+    }
+    for (auto limb = x.rbegin(); limb != x.rend(); ++limb) {
+      for (size_t j = 0; j < kPrimalityLanes; j++) {
+        r[j] = montgomery[j].Reduce(
+            static_cast<uint128_t>(r[j]) * montgomery[j].r2() + *limb);
+      }
+    }
+    for (size_t j = 0; j < count; j++) {
+      residues[i + j] = montgomery[j].Multiply(r[j], montgomery[j].r2());
+    }
+  }
+}
+
+// The smallest bound of `Presieve`. The wheel removes multiples of all
+// `kWheelPrimes`, so the bound can't be below any of them.
+inline constexpr int64_t kMinPresieveBound = std::end(kWheelPrimes)[-1];
+
+// Sieves windows of numbers from a given start by the primes up to a bound.
+class Presieve {
+ public:
+  // Computes the residues of `start` modulo the primes up to `bound`, which
+  // must be in [kMinPresieveBound, 2^32), using `threads` threads.
+  Presieve(const BigNumber& start, const int64_t bound, const int threads) {
+    ForPrimesBetween(Indexer::kNextPrime, bound, [this](const int64_t p) {
+      primes_.push_back(p);
+    });
+    // Relative offsets are counted from `start - shift_`, a multiple of
+    // `Indexer::kSize`. It's one row further below, so that no `Range`
+    // starts at 0, where `Range` takes 1 as composite.
+    shift_ = BigNumberMod(start, Indexer::kSize) + Indexer::kSize;
+    residues_.resize(primes_.size());
+    constexpr int64_t kBatch = 4096;
+    ParallelFor(threads, (std::ssize(primes_) + kBatch - 1) / kBatch,
+                [&](const int64_t batch) {
+                  const size_t begin = batch * kBatch;
+                  const size_t end =
+                      std::min<size_t>(begin + kBatch, primes_.size());
+                  BigNumberResidues(
+                      start,
+                      std::span<const uint32_t>(primes_).subspan(
+                          begin, end - begin),
+                      std::span<uint32_t>(residues_).subspan(begin,
+                                                             end - begin));
+                  // The residues of `start - shift_`.
+                  for (size_t i = begin; i < end; i++) {
+                    const int64_t p = primes_[i];
+                    residues_[i] = ((residues_[i] - shift_) % p + p) % p;
+                  }
+                });
+  }
+
+  // The relative offset of the start.
+  int64_t shift() const { return shift_; }
+
+  // Appends the offsets `i` of numbers `start + i`, for `i` in [lo, hi], not
+  // divisible by any prime up to the bound to `out`, in increasing order.
+  // Primes up to the bound aren't included even if they're in the window.
+  // Requires `0 <= lo <= hi` within `kChunkLength` rows of relative offsets.
+  void Survivors(const int64_t lo, const int64_t hi,
+                 std::vector<uint64_t>& out) const {
+    const int64_t first = lo + shift_;
+    const int64_t last = hi + shift_;
+    const int64_t offset = first / Indexer::kSize * Indexer::kSize;
+    Range range(offset, last / Indexer::kSize - offset / Indexer::kSize + 1);
+    for (size_t i = 0; i < primes_.size(); i++) {
+      range.Sieve(primes_[i], MinusMod(offset + residues_[i], primes_[i]));
+    }
+    std::vector<uint64_t> buffer(4096);
+    range.ForPrimeBatches(buffer, [&](const std::span<const uint64_t> batch) {
+      for (const uint64_t x : PrimesWithin(batch, first, last)) {
+        out.push_back(x - shift_);
+      }
+    });
+  }
+
+ private:
+  // The base primes above `kWheelPrimes`, increasing.
+  std::vector<uint32_t> primes_;
+  // `residues_[i]` is the residue of the number at relative offset 0 modulo
+  // `primes_[i]`.
+  std::vector<uint32_t> residues_;
+  int64_t shift_;
+};
+
+// Calls `f` with `std::span<const uint64_t>` batches of the offsets `i` in
+// [0, length) of numbers `start + i` with no prime factor up to `bound`, in
+// increasing order, sieving chunks in parallel on `threads` threads. `bound`
+// must be in [kMinPresieveBound, 2^32), and `start` should be above it.
+template <typename F>
+void ForPresieveSurvivors(const BigNumber& start, const int64_t length,
+                          const int64_t bound, const int threads, F&& f) {
+  if (length <= 0) {
+    return;
+  }
+  const Presieve presieve(start, bound, threads);
+  // Windows of relative offsets are aligned to rows, starting at the row of
+  // `shift()`, so that each of them is a single `Range`.
+  ForWindowsInOrder<uint64_t>(
+      Indexer::kSize, presieve.shift() + length - 1, kChunkSize, threads,
+      [&presieve](const int64_t lo, const int64_t hi,
+                  std::vector<uint64_t>& out) {
+        presieve.Survivors(std::max<int64_t>(lo - presieve.shift(), 0),
+                           hi - presieve.shift(), out);
+      },
+      std::forward<F>(f));
+}
+
+#endif  // ZILLION_PRIMES_PRESIEVE_H_
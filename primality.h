@@ -0,0 +1,305 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tests single 64-bit numbers for primality without sieving, by trial division
+// by small primes followed by the Miller-Rabin test with bases known to be
+// deterministic below 2^64.
+//
+// Miller-Rabin is a chain of dependent modular multiplications, which keeps a
+// single number waiting on the latency of each. So numbers are tested in
+// batches of `kPrimalityLanes`, advancing all of them by one multiplication
+// at a time, which lets the CPU overlap their chains. Multiplications are in
+// Montgomery form, without any division.
+
+#ifndef ZILLION_PRIMES_PRIMALITY_H_
+#define ZILLION_PRIMES_PRIMALITY_H_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+// Unsigned 128-bit integers, for products of 64-bit numbers and for sums
+// that don't fit into 64 bits.
+using uint128_t = unsigned __int128;
+
+// The number of numbers tested at once by `TestPrimes`.
+inline constexpr size_t kPrimalityLanes = 8;
+
+// Arithmetic modulo an odd `n` on numbers in Montgomery form `x 2^64 mod n`.
+class Montgomery {
+ public:
+  constexpr Montgomery() = default;
+  explicit constexpr Montgomery(const uint64_t n) : n_(n), inverse_(n) {
+    // Each step doubles the number of correct low bits, from 3 for `n`.
+    for (int i = 0; i < 5; i++) {
+      inverse_ *= 2 - n * inverse_;
+    }
+    one_ = -n % n;
+    r2_ = static_cast<uint128_t>(one_) * one_ % n;
+  }
+
+  // Returns `x` in Montgomery form.
+  constexpr uint64_t From(const uint64_t x) const {
+    return Multiply(x % n_, r2_);
+  }
+  // Returns `a b 2^-64 mod n`, which is the product for `a, b` in Montgomery
+  // form. Requires `a b < n 2^64`.
+  constexpr uint64_t Multiply(const uint64_t a, const uint64_t b) const {
+    return Reduce(static_cast<uint128_t>(a) * b);
+  }
+  // Returns `t 2^-64 mod n` for `t < n 2^64`.
+  constexpr uint64_t Reduce(const uint128_t t) const {
+    const uint64_t m = static_cast<uint64_t>(t) * inverse_;
+    const uint64_t high = t >> 64;
+    const uint64_t subtract = static_cast<uint128_t>(m) * n_ >> 64;
+    return high >= subtract ? high - subtract : high - subtract + n_;
+  }
+  // 1 and -1 in Montgomery form.
+  constexpr uint64_t one() const { return one_; }
+  constexpr uint64_t minus_one() const { return n_ - one_; }
+  // `2^128 mod n`, which `Multiply` takes numbers into Montgomery form with.
+  constexpr uint64_t r2() const { return r2_; }
+
+ private:
+  uint64_t n_ = 1;
+  // `n * inverse_ = 1 mod 2^64`.
+  uint64_t inverse_ = 1;
+  // `2^64 mod n` and `2^128 mod n`.
+  uint64_t one_ = 0;
+  uint64_t r2_ = 0;
+};
+
+// Odd primes below 2^7 with their inverses modulo 2^64, for dividing by them
+// by a multiplication: `n` is divisible by `p` iff `n * inverse <= limit`.
+inline constexpr struct TrialTable {
+  constexpr TrialTable() : primes(), inverses(), limits() {
+    for (uint64_t p = 3; p < kBound; p += 2) {
+      bool prime = true;
+      for (uint64_t d = 3; d * d <= p; d += 2) {
+        prime = prime && p % d != 0;
+      }
+      if (prime) {
+        uint64_t inverse = p;
+        for (int i = 0; i < 5; i++) {
+          inverse *= 2 - p * inverse;
+        }
+        primes[size] = p;
+        inverses[size] = inverse;
+        limits[size] = ~uint64_t{0} / p;
+        size++;
+      }
+    }
+  }
+
+  static constexpr uint64_t kBound = 128;
+
+  size_t size = 0;
+  uint64_t primes[kBound / 2];
+  uint64_t inverses[kBound / 2];
+  uint64_t limits[kBound / 2];
+} kTrialTable;
+
+// Returns 1 if `n` is prime, 0 if it's composite, or -1 if trial division by
+// the primes of `kTrialTable` doesn't tell.
+inline int TrialDivide(const uint64_t n) {
+  if (n < 2) {
+    return 0;
+  }
+  if (n % 2 == 0) {
+    return n == 2;
+  }
+  for (size_t i = 0; i < kTrialTable.size; i++) {
+    if (n * kTrialTable.inverses[i] <= kTrialTable.limits[i]) {
+      return n == kTrialTable.primes[i];
+    }
+  }
+  return n < TrialTable::kBound * TrialTable::kBound ? 1 : -1;
+}
+
+// Sets `x[i]` to `powers[i]^exponents[i]` for the first `kCount` lanes, all
+// in Montgomery form of their `montgomery[i]`, where exponents have at most
+// `bits` bits.
+//
+// Exponents are read in fixed windows of 4 bits from the top, each costing 4
+// squarings and a multiplication by a precomputed power, which is 1.25
+// multiplications per bit instead of up to 2. Leading zero windows of shorter
+// exponents keep `x` at 1. A fixed `kCount` lets the compiler interleave the
+// chains of all lanes.
+template <size_t kCount>
+void PowerLanes(const Montgomery* montgomery, const uint64_t* powers,
+                const uint64_t* exponents, const int bits, uint64_t* x) {
+  uint64_t table[16][kCount];
+  uint64_t y[kCount];
+  for (size_t i = 0; i < kCount; i++) {
+    table[0][i] = montgomery[i].one();
+    table[1][i] = powers[i];
+    y[i] = montgomery[i].one();
+  }
+  for (int k = 2; k < 16; k++) {
+    for (size_t i = 0; i < kCount; i++) {
+      table[k][i] = montgomery[i].Multiply(table[k - 1][i], powers[i]);
+    }
+  }
+  for (int shift = (bits + 3) / 4 * 4 - 4; shift >= 0; shift -= 4) {
+    for (int j = 0; j < 4; j++) {
+      for (size_t i = 0; i < kCount; i++) {
+        y[i] = montgomery[i].Multiply(y[i], y[i]);
+      }
+    }
+    for (size_t i = 0; i < kCount; i++) {
+      const uint64_t power = table[exponents[i] >> shift & 15][i];
+      y[i] = montgomery[i].Multiply(y[i], power);
+    }
+  }
+  for (size_t i = 0; i < kCount; i++) {
+    x[i] = y[i];
+  }
+}
+
+// Runs the Miller-Rabin test on the odd `numbers`, at most `kPrimalityLanes`
+// of them, with bases that are deterministic for all of them, and sets
+// `primes` accordingly.
+//
+// Each lane tests one number to one base. The first base runs on all numbers
+// and rules out nearly all composites. The remaining bases of the others then
+// share the lanes, so that the bases of a single prime run side by side
+// instead of one after another. Numbers are dropped as soon as a base shows
+// them composite.
+inline void MillerRabin(const std::span<const uint64_t> numbers,
+                        const std::span<bool> primes) {
+  static constexpr uint64_t kSmallBases[] = {2, 7, 61};
+  static constexpr uint64_t kLargeBases[] = {
+      2, 325, 9375, 28178, 450775, 9780504, 1795265022};
+  uint64_t largest = 0;
+  for (size_t i = 0; i < numbers.size(); i++) {
+    largest = std::max(largest, numbers[i]);
+    primes[i] = true;
+  }
+  const std::span<const uint64_t> bases =
+      largest >> 32 == 0 ? std::span<const uint64_t>(kSmallBases)
+                         : std::span<const uint64_t>(kLargeBases);
+  // The tests in the lanes: the index of the number and the base.
+  size_t lanes[kPrimalityLanes];
+  uint64_t lane_bases[kPrimalityLanes];
+  size_t size = 0;
+  auto run = [&] {
+    Montgomery montgomery[kPrimalityLanes];
+    uint64_t odd_parts[kPrimalityLanes];
+    int shifts[kPrimalityLanes];
+    uint64_t powers[kPrimalityLanes];
+    uint64_t x[kPrimalityLanes];
+    int bits = 0;
+    int max_shift = 0;
+    for (size_t i = 0; i < size; i++) {
+      const uint64_t n = numbers[lanes[i]];
+      montgomery[i] = Montgomery(n);
+      shifts[i] = std::countr_zero(n - 1);
+      odd_parts[i] = (n - 1) >> shifts[i];
+      powers[i] = montgomery[i].From(lane_bases[i]);
+      bits = std::max<int>(bits, std::bit_width(odd_parts[i]));
+      max_shift = std::max(max_shift, shifts[i]);
+    }
+    // `a^d`, with the number of lanes fixed at compile time.
+    [&]<size_t... kCounts>(std::index_sequence<kCounts...>) {
+      ((size == kCounts + 1
+            ? PowerLanes<kCounts + 1>(montgomery, powers, odd_parts, bits, x)
+            : void()),
+       ...);
+    }(std::make_index_sequence<kPrimalityLanes>());
+    // `n` passes if `a^d = 1` or `a^(d 2^r) = -1` for some `r < s`. A base
+    // divisible by `n` says nothing.
+    bool passed[kPrimalityLanes];
+    for (size_t i = 0; i < size; i++) {
+      passed[i] = powers[i] == 0 || x[i] == montgomery[i].one() ||
+                  x[i] == montgomery[i].minus_one();
+    }
+    for (int r = 1; r < max_shift; r++) {
+      for (size_t i = 0; i < size; i++) {
+        if (!passed[i] && r < shifts[i]) {
+          x[i] = montgomery[i].Multiply(x[i], x[i]);
+          passed[i] = x[i] == montgomery[i].minus_one();
+        }
+      }
+    }
+    for (size_t i = 0; i < size; i++) {
+      primes[lanes[i]] = primes[lanes[i]] && passed[i];
+    }
+    size = 0;
+  };
+  for (const uint64_t base : bases) {
+    for (size_t i = 0; i < numbers.size(); i++) {
+      if (primes[i]) {
+        lanes[size] = i;
+        lane_bases[size] = base;
+        if (++size == kPrimalityLanes) {
+          run();
+        }
+      }
+    }
+    // Only the first base waits for its lanes to finish.
+    if (base == bases[0] && size > 0) {
+      run();
+    }
+  }
+  if (size > 0) {
+    run();
+  }
+}
+
+// Sets `primes[i]` to whether `numbers[i]` is prime, for any 64-bit numbers.
+// `primes` must be at least as long as `numbers`.
+//
+// Numbers not decided by `TrialDivide` are collected and tested by
+// `MillerRabin` `kPrimalityLanes` at a time.
+inline void TestPrimes(const std::span<const uint64_t> numbers,
+                       const std::span<bool> primes) {
+  uint64_t batch[kPrimalityLanes];
+  size_t indices[kPrimalityLanes];
+  bool results[kPrimalityLanes];
+  size_t size = 0;
+  auto flush = [&] {
+    MillerRabin(std::span<const uint64_t>(batch, size),
+                std::span<bool>(results, size));
+    for (size_t j = 0; j < size; j++) {
+      primes[indices[j]] = results[j];
+    }
+    size = 0;
+  };
+  for (size_t i = 0; i < numbers.size(); i++) {
+    if (const int trial = TrialDivide(numbers[i]); trial >= 0) {
+      primes[i] = trial;
+      continue;
+    }
+    batch[size] = numbers[i];
+    indices[size] = i;
+    if (++size == kPrimalityLanes) {
+      flush();
+    }
+  }
+  if (size > 0) {
+    flush();
+  }
+}
+
+// Returns whether `n` is prime.
+inline bool IsPrime(const uint64_t n) {
+  bool prime;
+  TestPrimes(std::span<const uint64_t>(&n, 1), std::span<bool>(&prime, 1));
+  return prime;
+}
+
+#endif  // ZILLION_PRIMES_PRIMALITY_H_
@@ -0,0 +1,429 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Primes in arithmetic progressions `a + q k`.
+//
+// `ProgressionSieve` sieves only the numbers of a single progression, so
+// finding primes `= a (mod q)` costs about `1 / phi(q)` of sieving all
+// numbers. `CountPrimesByResidue` instead counts primes in all residue classes
+// modulo `q` at once.
+
+#ifndef ZILLION_PRIMES_PROGRESSIONS_H_
+#define ZILLION_PRIMES_PROGRESSIONS_H_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include "primality.h"
+#include "sieve.h"
+
+// Like `Indexer`, but for the numbers `a + q k` of a progression, indexed by
+// `k`. The wheel consists of the `kWheelPrimes` that don't divide `q`. Their
+// product `period()` is the period, in `k`, of which numbers of the
+// progression they divide. Each row of `period()` values of `k` is
+// represented by `words()` words, in which bit `i` stands for
+// `k = at(i)` if `i < bits()`. Bits at and above `bits()` are padding.
+class ProgressionIndexer {
+ public:
+  // `residue` must be in [0, modulus) and coprime to it.
+  ProgressionIndexer(const int64_t modulus, const int64_t residue)
+      : modulus_(modulus), residue_(residue) {
+    for (const int64_t p : kWheelPrimes) {
+      if (modulus % p != 0) {
+        period_ *= p;
+      }
+    }
+    index_of_.resize(period_, -1);
+    for (int64_t k = 0; k < period_; k++) {
+      if (std::gcd((residue + modulus % period_ * k) % period_, period_) ==
+          1) {
+        index_of_[k] = at_.size();
+        at_.push_back(k);
+      }
+    }
+    bits_ = at_.size();
+    words_ = (bits_ + 63) / 64;
+    at_.resize(64 * words_);
+  }
+
+  int64_t modulus() const { return modulus_; }
+  int64_t residue() const { return residue_; }
+  int64_t period() const { return period_; }
+  int64_t bits() const { return bits_; }
+  int64_t words() const { return words_; }
+  // The index of `k` in [0, period()) within a row, or -1 if `k` isn't
+  // represented.
+  int32_t index_of(const int64_t k) const { return index_of_[k]; }
+  // The `k` relative to its row at index `i`.
+  int64_t at(const int64_t i) const { return at_[i]; }
+
+ private:
+  const int64_t modulus_;
+  const int64_t residue_;
+  int64_t period_ = 1;
+  int64_t bits_;
+  int64_t words_;
+  std::vector<int32_t> index_of_;
+  std::vector<int64_t> at_;
+};
+
+// Like `Range`, a sieved range of `rows` rows of a progression starting at
+// `k = first`, which must be a multiple of `indexer.period()`.
+class ProgressionRange {
+ public:
+  ProgressionRange(const ProgressionIndexer& indexer, const int64_t first,
+                   const int64_t rows)
+      : indexer_(indexer),
+        first_(first),
+        max_(rows * indexer.period()),
+        words_(rows * indexer.words()) {
+    // Mark the padding.
+    if (indexer.bits() % 64 != 0) {
+      for (int64_t row = 0; row < rows; row++) {
+        words_[(row + 1) * indexer.words() - 1] |= ~uint64_t{0}
+                                                   << (indexer.bits() % 64);
+      }
+    }
+    // We don't consider 1 to be a prime.
+    if (const int64_t k = (1 - indexer.residue()) / indexer.modulus();
+        indexer.residue() + indexer.modulus() * k == 1 && first <= k &&
+        k < first + max_) {
+      Mark(k - first);
+    }
+  }
+
+  const ProgressionIndexer& indexer() const { return indexer_; }
+  // The first `k` of the range.
+  int64_t first() const { return first_; }
+  // The number of values of `k` represented by this range.
+  int64_t size() const { return max_; }
+
+  // Marks `k = first() + k`, `first() + k + p`, ... .
+  void Sieve(const int64_t p, int64_t k) {
+    for (; k < max_; k += p) {
+      Mark(k);
+    }
+  }
+
+  // Returns the number of numbers in the range that are marked as primes.
+  int64_t Count() const {
+    int64_t count = 0;
+    for (const uint64_t word : words_) {
+      count += std::popcount(~word);
+    }
+    return count;
+  }
+
+  // Runs `f` for all numbers `a + q k` in the range that are marked as primes,
+  // in increasing order, up to the largest that fits into `int64_t`.
+  template <typename F>
+  void ForPrimes(F&& f) const {
+    const int64_t words = indexer_.words();
+    const int64_t k_max =
+        (INT64_MAX - indexer_.residue()) / indexer_.modulus();
+    for (size_t j = 0; j < words_.size(); j++) {
+      const int64_t row_first = first_ + j / words * indexer_.period();
+      for (uint64_t bits = ~words_[j]; bits != 0; bits &= bits - 1) {
+        const int64_t k =
+            row_first + indexer_.at(j % words * 64 + std::countr_zero(bits));
+        if (k > k_max) {
+          return;
+        }
+        f(indexer_.residue() + indexer_.modulus() * k);
+      }
+    }
+  }
+
+ private:
+  void Mark(const int64_t k) {
+    const int32_t index = indexer_.index_of(k % indexer_.period());
+    if (index >= 0) {
+      words_[k / indexer_.period() * indexer_.words() + index / 64] |=
+          uint64_t{1} << (index % 64);
+    }
+  }
+
+  const ProgressionIndexer& indexer_;
+  const int64_t first_;
+  const int64_t max_;
+  std::vector<uint64_t> words_;
+};
+
+// Sieves the numbers `a + q k` up to a given maximum for primes.
+//
+// For each base prime `p` not dividing `q`, the `k` of the multiples of `p`
+// are `-a / q (mod p)`. These roots are computed once, so sieving a range
+// costs the same as with `Range`.
+class ProgressionSieve {
+ public:
+  // `residue` must be in [0, modulus) and coprime to it.
+  ProgressionSieve(const int64_t modulus, const int64_t residue,
+                   const int64_t maximum)
+      : indexer_(modulus, residue), maximum_(maximum) {
+    // Base primes that divide `modulus` never divide `a + q k`.
+    BasePrimes(maximum).range().ForPrimes([this, modulus,
+                                           residue](const int64_t p) {
+      if (modulus % p != 0) {
+        // Both factors are below `p < 2^32`.
+        roots_.push_back({p, static_cast<int64_t>(
+                                 static_cast<uint64_t>(p - residue % p) *
+                                 Inverse(modulus % p, p) % p)});
+      }
+    });
+  }
+
+  const ProgressionIndexer& indexer() const { return indexer_; }
+
+  // Returns the number of `k` in each chunk, a multiple of the period of
+  // `indexer()` with about as many bits as a `Range` chunk.
+  int64_t chunk_size() const {
+    return std::max<int64_t>(kChunkLength * Indexer::kBits / indexer_.bits(),
+                             1) *
+           indexer_.period();
+  }
+
+  // Returns a range of `rows` rows starting at `k = first`, sieved by all base
+  // primes up to the square root of its last number, or of the maximum if
+  // that's smaller. Numbers above the maximum aren't sieved correctly.
+  ProgressionRange Sieve(const int64_t first, const int64_t rows) const {
+    ProgressionRange range(indexer_, first, rows);
+    const int64_t q = indexer_.modulus();
+    const int64_t a = indexer_.residue();
+    // Near 2^63, numbers of the range may not fit into `int64_t`.
+    const int64_t last = std::min<uint128_t>(
+        a + static_cast<uint128_t>(q) * (first + range.size() - 1), maximum_);
+    for (const auto [p, root] : roots_) {
+      if (p > last / p) {
+        break;
+      }
+      // The first `k >= first` with `p | a + q k` and `a + q k >= p * p`.
+      // As `p * p <= last`, `k - first` fits into `int64_t`.
+      int64_t k = first + (root - first % p + p) % p;
+      const uint128_t n = a + static_cast<uint128_t>(q) * k;
+      if (n < static_cast<uint128_t>(p * p)) {
+        const uint128_t step = static_cast<uint128_t>(q) * p;
+        k += (p * p - n + step - 1) / step * p;
+      }
+      range.Sieve(p, k - first);
+    }
+    return range;
+  }
+
+ private:
+  // Returns the inverse of `x` modulo a prime `p`.
+  static int64_t Inverse(int64_t x, int64_t p) {
+    int64_t a = 0;
+    int64_t b = 1;
+    for (int64_t m = p; x != 0;) {
+      const int64_t t = m / x;
+      m -= t * x;
+      std::swap(m, x);
+      a -= t * b;
+      std::swap(a, b);
+    }
+    return (a % p + p) % p;
+  }
+
+  struct Root {
+    int64_t p;
+    // `p | a + q k` iff `k = root (mod p)`.
+    int64_t root;
+  };
+
+  ProgressionIndexer indexer_;
+  const int64_t maximum_;
+  std::vector<Root> roots_;
+};
+
+// Calls `f(range, thread)` for chunks of `sieve` that together cover all
+// numbers of its progression in [lo, hi], in parallel on `threads` threads.
+// Chunks may extend past `lo` and `hi`.
+template <typename F>
+void ParallelForProgressionChunks(const ProgressionSieve& sieve,
+                                  const int64_t lo, const int64_t hi,
+                                  const int threads, F&& f) {
+  const ProgressionIndexer& indexer = sieve.indexer();
+  const int64_t q = indexer.modulus();
+  const int64_t a = indexer.residue();
+  // The range of `k` with `lo <= a + q k <= hi`, rounding up without
+  // overflowing near 2^63.
+  const int64_t k_lo = lo <= a ? 0 : (lo - a - 1) / q + 1;
+  const int64_t k_hi = hi < a ? -1 : (hi - a) / q;
+  const int64_t start = k_lo / indexer.period() * indexer.period();
+  const int64_t chunk = sieve.chunk_size();
+  const int64_t chunk_count = k_hi >= k_lo ? (k_hi - start) / chunk + 1 : 0;
+  ParallelFor(threads, chunk_count, [&](const int64_t i, const int thread) {
+    const int64_t first = start + i * chunk;
+    const int64_t rows =
+        std::min(chunk, k_hi - first + 1 + indexer.period() - 1) /
+        indexer.period();
+    f(sieve.Sieve(first, rows), thread);
+  });
+}
+
+// Returns the primes `p = residue (mod modulus)` that aren't found by sieving
+// the progression: The `kWheelPrimes`, and those that divide `modulus`. The
+// latter can only be `residue` or `modulus` itself.
+inline std::vector<int64_t> SmallProgressionPrimes(const int64_t modulus,
+                                                   const int64_t residue) {
+  std::vector<int64_t> candidates(std::begin(kWheelPrimes),
+                                  std::end(kWheelPrimes));
+  candidates.push_back(residue);
+  candidates.push_back(modulus);
+  std::sort(candidates.begin(), candidates.end());
+  candidates.erase(std::unique(candidates.begin(), candidates.end()),
+                   candidates.end());
+  std::vector<int64_t> primes;
+  for (const int64_t p : candidates) {
+    if (IsPrime(p) && p % modulus == residue &&
+        (p < Indexer::kNextPrime || modulus % p == 0)) {
+      primes.push_back(p);
+    }
+  }
+  return primes;
+}
+
+// Returns whether all numbers of the progression in `range` are in [lo, hi].
+inline bool IsInside(const ProgressionRange& range, const int64_t lo,
+                     const int64_t hi) {
+  const int64_t q = range.indexer().modulus();
+  const int64_t a = range.indexer().residue();
+  // The numbers may not fit into `int64_t` near 2^63.
+  return lo <= a + static_cast<__int128>(q) * range.first() &&
+         a + static_cast<__int128>(q) * (range.first() + range.size() - 1) <=
+             hi;
+}
+
+// Calls `f` for all primes `p = residue (mod modulus)` in [lo, hi] in
+// increasing order. `residue` must be in [0, modulus).
+template <typename F>
+void ForPrimesInProgression(const int64_t modulus, const int64_t residue,
+                            const int64_t lo, const int64_t hi, F&& f) {
+  for (const int64_t p : SmallProgressionPrimes(modulus, residue)) {
+    if (lo <= p && p <= hi) {
+      f(p);
+    }
+  }
+  if (std::gcd(modulus, residue) != 1) {
+    return;
+  }
+  const ProgressionSieve sieve(modulus, residue, hi);
+  // With a single thread, chunks are sieved in order.
+  ParallelForProgressionChunks(
+      sieve, lo, hi, 1, [lo, hi, &f](const ProgressionRange& range, int) {
+        range.ForPrimes([lo, hi, &f](const int64_t p) {
+          if (lo <= p && p <= hi) {
+            f(p);
+          }
+        });
+      });
+}
+
+// Returns the number of primes `p = residue (mod modulus)` in [lo, hi], using
+// `threads` threads. `residue` must be in [0, modulus).
+inline int64_t CountPrimesInProgression(const int64_t modulus,
+                                        const int64_t residue,
+                                        const int64_t lo, const int64_t hi,
+                                        const int threads = 1) {
+  int64_t count = 0;
+  for (const int64_t p : SmallProgressionPrimes(modulus, residue)) {
+    count += lo <= p && p <= hi;
+  }
+  if (std::gcd(modulus, residue) != 1) {
+    return count;
+  }
+  const ProgressionSieve sieve(modulus, residue, hi);
+  std::vector<int64_t> counts(threads);
+  ParallelForProgressionChunks(
+      sieve, lo, hi, threads,
+      [lo, hi, &counts](const ProgressionRange& range, const int thread) {
+        if (IsInside(range, lo, hi)) {
+          counts[thread] += range.Count();
+        } else {
+          range.ForPrimes([lo, hi, &counts, thread](const int64_t p) {
+            counts[thread] += lo <= p && p <= hi;
+          });
+        }
+      });
+  for (const int64_t c : counts) {
+    count += c;
+  }
+  return count;
+}
+
+// The largest modulus of `CountPrimesByResidue`. Each thread keeps a count for
+// every residue class, so this bounds its memory to 8 MB per thread.
+inline constexpr int64_t kMaxResidueModulus = 1000000;
+
+// Returns the number of primes in [lo, hi] in each residue class modulo
+// `modulus`, which must be at most `kMaxResidueModulus`, sieving chunks in
+// parallel on `threads` threads, each with its own vector of counts.
+//
+// Residues are computed per row of a `Range` as the residue of its offset
+// plus a precomputed residue of each bit position, so counting a prime costs
+// an addition and a comparison rather than a division.
+inline std::vector<int64_t> CountPrimesByResidue(const int64_t modulus,
+                                                 const int64_t lo,
+                                                 const int64_t hi,
+                                                 const int threads = 1) {
+  std::vector<int64_t> residues(Indexer::kBits);
+  for (int64_t i = 0; i < Indexer::kBits; i++) {
+    residues[i] = kIndexer.atIndex[i] % modulus;
+  }
+  std::vector<std::vector<int64_t>> counts(threads,
+                                           std::vector<int64_t>(modulus));
+  for (const int64_t p : kWheelPrimes) {
+    if (lo <= p && p <= hi) {
+      counts[0][p % modulus]++;
+    }
+  }
+  ParallelForChunksBetween(
+      BasePrimes(hi), lo, hi, threads,
+      [&](const Range& range, const int thread) {
+        std::vector<int64_t>& count = counts[thread];
+        const bool inside =
+            lo <= range.offset() && range.offset() + range.size() <= hi + 1;
+        const std::vector<uint64_t>& words = range.words();
+        for (size_t j = 0; j < words.size(); j++) {
+          const int64_t offset =
+              range.offset() + j / Range::kWords * Indexer::kSize;
+          const int64_t base = offset % modulus;
+          const int64_t* residue = &residues[j % Range::kWords * 64];
+          const int64_t* at = &kIndexer.atIndex[j % Range::kWords * 64];
+          for (uint64_t bits = ~words[j]; bits != 0; bits &= bits - 1) {
+            const int index = std::countr_zero(bits);
+            if (!inside &&
+                (offset + at[index] < lo || offset + at[index] > hi)) {
+              continue;
+            }
+            const int64_t r = base + residue[index];
+            count[r >= modulus ? r - modulus : r]++;
+          }
+        }
+      });
+  for (int t = 1; t < threads; t++) {
+    for (int64_t r = 0; r < modulus; r++) {
+      counts[0][r] += counts[t][r];
+    }
+  }
+  return counts[0];
+}
+
+#endif  // ZILLION_PRIMES_PROGRESSIONS_H_
@@ -0,0 +1,105 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Answers queries about a file of primes produced by `sieve`.
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "reader.h"
+
+// Parses decimal `text` into `x`. Returns false if it's malformed or out of
+// range.
+bool ParseNumber(const char* text, int64_t& x) {
+  const char* const end = text + strlen(text);
+  const auto [rest, error] = std::from_chars(text, end, x);
+  return error == std::errc() && rest == end;
+}
+
+int main(int argc, char* argv[]) {
+  const std::string query = argc >= 3 ? argv[2] : "";
+  const int arguments = query == "range"                       ? 2
+                        : query == "size" || query == "verify" ? 0
+                                                               : 1;
+  // The numbers given after `query`.
+  int64_t numbers[2] = {};
+  bool valid = argc == 3 + arguments &&
+               (query == "nth" || query == "pi" || query == "next" ||
+                query == "range" || query == "size" || query == "verify");
+  for (int i = 0; valid && i < arguments; i++) {
+    valid = ParseNumber(argv[3 + i], numbers[i]);
+  }
+  if (!valid) {
+    std::cerr << "Answers queries about a file of primes produced by `sieve`."
+              << std::endl
+              << std::endl
+              << "Usage: " << argv[0] << " FILE QUERY" << std::endl
+              << std::endl
+              << "  size         The number of primes in FILE." << std::endl
+              << "  nth N        The N-th prime, counting from 1." << std::endl
+              << "  pi X         The number of primes <= X." << std::endl
+              << "  next X       The smallest prime > X." << std::endl
+              << "  range LO HI  All primes in [LO, HI]." << std::endl
+              << "  verify       Check that FILE holds increasing primes."
+              << std::endl;
+    return 1;
+  }
+  const PrimeFile file(argv[1]);
+  if (!file.ok()) {
+    std::perror(argv[1]);
+    return 1;
+  }
+  const int64_t x = numbers[0];
+  if (query == "size") {
+    std::cout << file.size() << std::endl;
+  } else if (query == "verify") {
+    file.AdviseSequential();
+    if (const int64_t index = file.Verify(); index < file.size()) {
+      std::cerr << "Number " << index + 1 << " of " << argv[1] << ", "
+                << file.begin()[index]
+                << ", isn't a prime larger than the one before it"
+                << std::endl;
+      return 1;
+    }
+    std::cout << file.size() << " increasing primes" << std::endl;
+  } else if (query == "nth") {
+    if (x < 1 || x > file.size()) {
+      std::cerr << "N must be between 1 and " << file.size() << std::endl;
+      return 1;
+    }
+    file.AdviseRandom();
+    std::cout << file.Nth(x) << std::endl;
+  } else if (query == "pi") {
+    file.AdviseRandom();
+    std::cout << file.Pi(x) << std::endl;
+  } else if (query == "next") {
+    file.AdviseRandom();
+    const int64_t p = file.NextPrime(x);
+    if (p == 0) {
+      std::cerr << "No prime > " << x << " in " << argv[1] << std::endl;
+      return 1;
+    }
+    std::cout << p << std::endl;
+  } else {
+    file.AdviseSequential();
+    for (const int64_t p : file.Between(x, numbers[1])) {
+      std::cout << p << '\n';
+    }
+  }
+  return 0;
+}
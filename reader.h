@@ -0,0 +1,237 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Read-only access to files of 64-bit little-endian primes produced by
+// `sieve`.
+
+#ifndef ZILLION_PRIMES_READER_H_
+#define ZILLION_PRIMES_READER_H_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <span>
+
+#include "primality.h"
+
+// Reads a 64-bit little-endian number from `in[0..7]`.
+inline int64_t DecodeLittleEndian(const unsigned char* in) {
+  uint64_t p = 0;
+  for (size_t i = 0; i < 8; i++) {
+    p |= static_cast<uint64_t>(in[i]) << (8 * i);
+  }
+  return p;
+}
+
+// A file of increasing primes `mmap`-ed into memory.
+//
+// All queries are answered directly from the mapping: `Nth` is a single load,
+// `Pi` and `NextPrime` are a branch-free binary search. Answers are only exact
+// up to the bound the file was generated with.
+class PrimeFile {
+ public:
+  // Iterates over the primes of the file in increasing order.
+  class Iterator {
+   public:
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = int64_t;
+    using difference_type = ptrdiff_t;
+    using pointer = const int64_t*;
+    using reference = int64_t;
+
+    explicit Iterator(const unsigned char* at = nullptr) : at_(at) {}
+
+    int64_t operator*() const { return DecodeLittleEndian(at_); }
+    int64_t operator[](ptrdiff_t i) const { return *(*this + i); }
+    Iterator& operator++() {
+      at_ += 8;
+      return *this;
+    }
+    Iterator operator++(int) {
+      Iterator copy = *this;
+      at_ += 8;
+      return copy;
+    }
+    Iterator& operator--() {
+      at_ -= 8;
+      return *this;
+    }
+    Iterator operator--(int) {
+      Iterator copy = *this;
+      at_ -= 8;
+      return copy;
+    }
+    Iterator& operator+=(ptrdiff_t n) {
+      at_ += 8 * n;
+      return *this;
+    }
+    Iterator& operator-=(ptrdiff_t n) {
+      at_ -= 8 * n;
+      return *this;
+    }
+    Iterator operator+(ptrdiff_t n) const { return Iterator(at_ + 8 * n); }
+    Iterator operator-(ptrdiff_t n) const { return Iterator(at_ - 8 * n); }
+    ptrdiff_t operator-(const Iterator& other) const {
+      return (at_ - other.at_) / 8;
+    }
+    bool operator==(const Iterator& other) const { return at_ == other.at_; }
+    bool operator!=(const Iterator& other) const { return at_ != other.at_; }
+    bool operator<(const Iterator& other) const { return at_ < other.at_; }
+    bool operator>(const Iterator& other) const { return at_ > other.at_; }
+    bool operator<=(const Iterator& other) const { return at_ <= other.at_; }
+    bool operator>=(const Iterator& other) const { return at_ >= other.at_; }
+    friend Iterator operator+(ptrdiff_t n, const Iterator& it) {
+      return it + n;
+    }
+
+   private:
+    const unsigned char* at_;
+  };
+
+  // A pair of iterators usable in a range-based `for` loop.
+  struct Primes {
+    Iterator begin() const { return first; }
+    Iterator end() const { return last; }
+
+    Iterator first;
+    Iterator last;
+  };
+
+  // Maps the file at `path`. If that fails, `ok()` returns false and `errno`
+  // describes the error.
+  explicit PrimeFile(const char* path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0) {
+      size_ = info.st_size / 8;
+      if (size_ == 0) {
+        ok_ = true;
+      } else {
+        void* data = mmap(nullptr, size_ * 8, PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED) {
+          data_ = static_cast<const unsigned char*>(data);
+          ok_ = true;
+        }
+      }
+    }
+    close(fd);
+  }
+  PrimeFile(const PrimeFile&) = delete;
+  PrimeFile& operator=(const PrimeFile&) = delete;
+
+  ~PrimeFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<unsigned char*>(data_), size_ * 8);
+    }
+  }
+
+  bool ok() const { return ok_; }
+
+  // The number of primes in the file.
+  int64_t size() const { return size_; }
+
+  Iterator begin() const { return Iterator(data_); }
+  Iterator end() const { return Iterator(data_ + size_ * 8); }
+
+  // Returns the `n`-th prime, counting from 1, that is `Nth(1) == 2`. `n` must
+  // be in [1, size()].
+  int64_t Nth(int64_t n) const { return begin()[n - 1]; }
+
+  // Returns the number of primes <= `x`.
+  int64_t Pi(int64_t x) const {
+    if (size_ == 0) {
+      return 0;
+    }
+    // Invariant: All primes before `base` are <= x and all primes from
+    // `base + length` on are > x. The conditional compiles to a `cmov`.
+    const unsigned char* base = data_;
+    int64_t length = size_;
+    while (length > 1) {
+      const int64_t half = length / 2;
+      base = DecodeLittleEndian(base + 8 * half) <= x ? base + 8 * half : base;
+      length -= half;
+    }
+    return (base - data_) / 8 + (DecodeLittleEndian(base) <= x);
+  }
+
+  // Returns the smallest prime > `x`, or 0 if the file contains no such prime.
+  int64_t NextPrime(int64_t x) const {
+    const int64_t index = Pi(x);
+    return index < size_ ? begin()[index] : 0;
+  }
+
+  // Returns the primes in [lo, hi].
+  Primes Between(int64_t lo, int64_t hi) const {
+    // There are no primes below 2, and `lo - 1` may not fit into `int64_t`.
+    const Iterator first = begin() + (lo <= 2 ? 0 : Pi(lo - 1));
+    return {first, hi < lo ? first : begin() + Pi(hi)};
+  }
+
+  // Returns the index of the first number of the file that isn't a prime
+  // larger than the one before it, or `size()` if there is none.
+  //
+  // Numbers are tested in batches by `TestPrimes`, so that the file can be
+  // verified without sieving up to its last prime.
+  int64_t Verify() const {
+    constexpr int64_t kBatchSize = 1024;
+    uint64_t numbers[kBatchSize];
+    bool primes[kBatchSize];
+    uint64_t previous = 0;
+    for (int64_t start = 0; start < size_; start += kBatchSize) {
+      const int64_t count = std::min(kBatchSize, size_ - start);
+      for (int64_t i = 0; i < count; i++) {
+        numbers[i] = DecodeLittleEndian(data_ + 8 * (start + i));
+      }
+      TestPrimes(std::span<const uint64_t>(numbers, count), primes);
+      for (int64_t i = 0; i < count; i++) {
+        if (!primes[i] || numbers[i] <= previous) {
+          return start + i;
+        }
+        previous = numbers[i];
+      }
+    }
+    return size_;
+  }
+
+  // Hints the kernel that the file will be read sequentially, so that it reads
+  // ahead aggressively.
+  void AdviseSequential() const { Advise(MADV_SEQUENTIAL); }
+  // Hints the kernel that the file will be accessed at random, so that it
+  // doesn't waste I/O on reading ahead.
+  void AdviseRandom() const { Advise(MADV_RANDOM); }
+  // Hints the kernel to start reading the whole file into memory.
+  void AdviseWillNeed() const { Advise(MADV_WILLNEED); }
+
+ private:
+  void Advise(int advice) const {
+    if (data_ != nullptr) {
+      madvise(const_cast<unsigned char*>(data_), size_ * 8, advice);
+    }
+  }
+
+  const unsigned char* data_ = nullptr;
+  int64_t size_ = 0;
+  bool ok_ = false;
+};
+
+#endif  // ZILLION_PRIMES_READER_H_
@@ -0,0 +1,537 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A long-running server answering prime queries over a Unix domain socket.
+//
+// Clients send queries of three 64-bit integers `{op, x, y}` and receive
+// 64-bit integers back, all in host byte order:
+//
+//   op = 1  Is `x` a prime? Answers 1 or 0.
+//   op = 2  The smallest prime > `x`.
+//   op = 3  The number of primes <= `x`.
+//   op = 4  The primes in [x, y]: their count `n`, followed by `n` primes.
+//   op = 5  The largest prime < `x`.
+//
+// Invalid queries, such as negative numbers, an unknown `op`, no prime > `x`
+// below 2^63, no prime < `x` or an interval longer than `kMaxInterval`, are
+// answered with -1.
+// Queries are answered in order, so clients can batch many of them into a
+// single write and pipeline further ones without waiting for the answers.
+//
+// Numbers in recently sieved segments are answered from a cache of them.
+// Others are tested by Miller-Rabin, see primality.h, in batches for `op = 1`.
+// Only `op = 4` sieves segments into the cache, below `kMaxSieved`, and tests
+// its numbers above. `op = 3` with small `x` is answered from a range sieved
+// once. With large `x` it takes long, see `PrimePi`, so it's answered by a
+// worker thread, delaying only the later answers to the same client.
+
+#ifndef ZILLION_PRIMES_SERVER_H_
+#define ZILLION_PRIMES_SERVER_H_
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "output.h"
+#include "pi.h"
+#include "primality.h"
+#include "sieve.h"
+
+// Keeps recently sieved segments of `kSegmentLength` rows, evicting the least
+// recently used one once there are `capacity` of them. Base primes are kept
+// too, and grown as larger numbers are queried.
+class SegmentCache {
+ public:
+  // Short segments keep the cost of a cache miss low, as the sieving cost is
+  // then dominated by a single division per base prime.
+  static constexpr int64_t kSegmentLength = 4;
+  static constexpr int64_t kSegmentSize = kSegmentLength * Indexer::kSize;
+
+  explicit SegmentCache(size_t capacity = 1024) : capacity_(capacity) {}
+
+  // Returns the cached segment containing `x >= 0`, or null if there is none.
+  const Range* Find(const int64_t x) {
+    const auto it = index_.find(x / kSegmentSize * kSegmentSize);
+    if (it == index_.end()) {
+      return nullptr;
+    }
+    segments_.splice(segments_.begin(), segments_, it->second);
+    return &*it->second;
+  }
+
+  // Returns the sieved segment containing `x >= 0`.
+  const Range& Segment(const int64_t x) {
+    if (const Range* range = Find(x); range != nullptr) {
+      return *range;
+    }
+    const int64_t start = x / kSegmentSize * kSegmentSize;
+    if (segments_.size() == capacity_) {
+      index_.erase(segments_.back().offset());
+      segments_.pop_back();
+    }
+    // The last segment extends past 2^63 - 1. It can be sieved just the
+    // same, as it's only ever queried below that.
+    GrowBasePrimes(base_,
+                   std::min<uint64_t>(static_cast<uint64_t>(start) +
+                                          kSegmentSize,
+                                      std::numeric_limits<int64_t>::max()));
+    Range& range = segments_.emplace_front(start, kSegmentLength);
+    base_->Sieve(range);
+    index_.emplace(start, segments_.begin());
+    return range;
+  }
+
+ private:
+  const size_t capacity_;
+  std::unique_ptr<BasePrimes> base_;
+  // Most recently used segments first.
+  std::list<Range> segments_;
+  std::unordered_map<int64_t, std::list<Range>::iterator> index_;
+};
+
+// Answers queries described at the top of this file.
+class PrimeServer {
+ public:
+  enum Op : int64_t {
+    kIsPrime = 1,
+    kNextPrime = 2,
+    kPi = 3,
+    kPrimes = 4,
+    kPrevPrime = 5,
+  };
+  // The size of a query in bytes.
+  static constexpr size_t kQuerySize = 3 * sizeof(int64_t);
+  // The longest interval allowed in a `kPrimes` query.
+  static constexpr int64_t kMaxInterval = int64_t{1} << 26;
+  // `kPi` queries below this are answered from a sieved range of all numbers
+  // up to it, as `PrimePi` would count them by sieving.
+  static constexpr int64_t kSmallPi = 100000000;
+  // `kPrimes` queries test their numbers from here on instead of sieving them.
+  // Sieving a segment takes a division per base prime, which is slower there
+  // than testing its numbers, and the base primes up to 2^32 needed near 2^63
+  // take minutes to seed.
+  static constexpr int64_t kMaxSieved = int64_t{1} << 50;
+
+  // `threads` are used for `kPi` queries.
+  explicit PrimeServer(int threads = 1) : threads_(threads) {}
+
+  // Returns whether `x` is a prime if its segment is cached, or -1.
+  int CachedIsPrime(const int64_t x) {
+    const Range* range = cache_.Find(x);
+    if (range == nullptr) {
+      return -1;
+    }
+    return x < Indexer::kNextPrime
+               ? std::find(std::begin(kWheelPrimes), std::end(kWheelPrimes),
+                           x) != std::end(kWheelPrimes)
+               : range->IsPrime(x - range->offset());
+  }
+
+  // Returns whether `x` is a prime.
+  bool IsPrime(const int64_t x) {
+    const int cached = CachedIsPrime(x);
+    return cached >= 0 ? cached : ::IsPrime(x);
+  }
+
+  // Returns the smallest prime > `x`, or -1 if it doesn't fit into `int64_t`.
+  int64_t NextPrime(const int64_t x) {
+    if (x < Indexer::kNextPrime || x >= kLargestPrime ||
+        cache_.Find(x + 1) == nullptr) {
+      return ::NextPrime(x);
+    }
+    for (int64_t from = x + 1;;) {
+      const Range& range = cache_.Segment(from);
+      const int64_t next = range.NextPrime(from - range.offset());
+      if (next < range.size()) {
+        return range.offset() + next;
+      }
+      from = range.offset() + range.size();
+    }
+  }
+
+  // Returns the largest prime < `x`, or -1 if there is none.
+  int64_t PrevPrime(const int64_t x) {
+    if (x <= Indexer::kNextPrime || cache_.Find(x - 1) == nullptr) {
+      return ::PrevPrime(x);
+    }
+    for (int64_t to = x - 1;;) {
+      const Range& range = cache_.Segment(to);
+      const int64_t prev = range.PrevPrime(to - range.offset());
+      if (prev >= 0) {
+        return range.offset() + prev;
+      }
+      to = range.offset() - 1;
+    }
+  }
+
+  // Returns the number of primes <= `x`.
+  int64_t Pi(const int64_t x) {
+    if (x >= kSmallPi) {
+      return PrimePi(x, threads_);
+    }
+    if (small_ == nullptr) {
+      small_ = std::make_unique<Range>(0, kSmallPi / Indexer::kSize + 1);
+      BasePrimes(kSmallPi).Sieve(*small_);
+      const std::vector<uint64_t>& words = small_->words();
+      small_counts_.resize(words.size());
+      for (size_t j = 1; j < words.size(); j++) {
+        small_counts_[j] = small_counts_[j - 1] + std::popcount(~words[j - 1]);
+      }
+    }
+    int64_t count = std::count_if(std::begin(kWheelPrimes),
+                                  std::end(kWheelPrimes),
+                                  [x](const int64_t p) { return p <= x; });
+    // Count the bits up to that of the last number <= `x` not divisible by
+    // `kWheelPrimes`, as in `Range::PrevPrime`.
+    const int64_t row = x / Indexer::kSize;
+    int64_t r = x % Indexer::kSize;
+    while (r >= 0 && kIndexer.indexOf[r] < 0) {
+      r--;
+    }
+    const int64_t bit = r >= 0 ? row * Indexer::kBits + kIndexer.indexOf[r]
+                               : row * Indexer::kBits - 1;
+    if (bit >= 0) {
+      count += small_counts_[bit / 64] +
+               std::popcount(~small_->words()[bit / 64] &
+                             (~uint64_t{0} >> (63 - bit % 64)));
+    }
+    return count;
+  }
+
+  // Appends the count of primes in [lo, hi] and the primes themselves to
+  // `out`.
+  void Primes(const int64_t lo, const int64_t hi, std::vector<int64_t>& out) {
+    const size_t count_at = out.size();
+    out.push_back(0);
+    for (const int64_t p : kWheelPrimes) {
+      if (lo <= p && p <= hi) {
+        out.push_back(p);
+      }
+    }
+    const int64_t sieved = std::min(hi, kMaxSieved - 1);
+    for (int64_t from = lo; from <= sieved;) {
+      const Range& range = cache_.Segment(from);
+      range.ForPrimeBatches(
+          buffer_, [lo, sieved, &out](const std::span<const uint64_t> primes) {
+            const std::span<const uint64_t> within =
+                PrimesWithin(primes, lo, sieved);
+            out.insert(out.end(), within.begin(), within.end());
+          });
+      if (sieved - range.offset() < range.size()) {
+        break;
+      }
+      from = range.offset() + range.size();
+    }
+    if (hi >= kMaxSieved) {
+      TestPrimesBetween(std::max(lo, kMaxSieved), hi, out);
+    }
+    out[count_at] = out.size() - count_at - 1;
+  }
+
+  // Appends the primes in [lo, hi] to `out`, for `lo >= Indexer::kNextPrime`,
+  // testing the numbers not divisible by `kWheelPrimes` in batches.
+  void TestPrimesBetween(const int64_t lo, const int64_t hi,
+                         std::vector<int64_t>& out) {
+    const std::unique_ptr<bool[]> primes(new bool[buffer_.size()]);
+    size_t count = 0;
+    auto test = [&]() {
+      TestPrimes(std::span<const uint64_t>(buffer_.data(), count),
+                 std::span<bool>(primes.get(), count));
+      for (size_t i = 0; i < count; i++) {
+        if (primes[i]) {
+          out.push_back(buffer_[i]);
+        }
+      }
+      count = 0;
+    };
+    // `x` may reach 2^63, past `hi`.
+    for (uint64_t x = lo; x <= static_cast<uint64_t>(hi); x++) {
+      if (kIndexer.indexOf[x % Indexer::kSize] >= 0) {
+        buffer_[count++] = x;
+        if (count == buffer_.size()) {
+          test();
+        }
+      }
+    }
+    test();
+  }
+
+  // Answers the queries in `queries`, which holds a multiple of `kQuerySize`
+  // bytes, appending the answers to `out`.
+  //
+  // If `deferred` isn't null, `kPi` queries of at least `kSmallPi` are left to
+  // the caller instead: their `x` is appended in place of the answer, and its
+  // position in `out` to `deferred`.
+  void Answer(const char* queries, const size_t size, std::vector<int64_t>& out,
+              std::vector<size_t>* deferred = nullptr) {
+    // `op = 1` queries missing the cache, tested together at the end, and the
+    // positions of their answers.
+    std::vector<uint64_t> tests;
+    std::vector<size_t> positions;
+    for (size_t i = 0; i < size; i += kQuerySize) {
+      int64_t query[3];
+      memcpy(query, queries + i, kQuerySize);
+      const auto [op, x, y] = query;
+      if (x < 0) {
+        out.push_back(-1);
+      } else if (op == kIsPrime) {
+        if (const int cached = CachedIsPrime(x); cached >= 0) {
+          out.push_back(cached);
+        } else {
+          tests.push_back(x);
+          positions.push_back(out.size());
+          out.push_back(0);
+        }
+      } else if (op == kNextPrime) {
+        out.push_back(NextPrime(x));
+      } else if (op == kPrevPrime) {
+        out.push_back(PrevPrime(x));
+      } else if (op == kPi && x >= kSmallPi && deferred != nullptr) {
+        deferred->push_back(out.size());
+        out.push_back(x);
+      } else if (op == kPi) {
+        out.push_back(Pi(x));
+      } else if (op == kPrimes && y >= x - 1 && y - x < kMaxInterval) {
+        Primes(x, y, out);
+      } else {
+        out.push_back(-1);
+      }
+    }
+    const std::unique_ptr<bool[]> primes(new bool[tests.size()]);
+    TestPrimes(tests, std::span<bool>(primes.get(), tests.size()));
+    for (size_t i = 0; i < tests.size(); i++) {
+      out[positions[i]] = primes[i];
+    }
+  }
+
+  // Listens on a Unix domain socket at `path` and answers queries of all
+  // clients until killed. Clients are served one batch at a time in a single
+  // thread, so that queries don't contend for the cache. Only large `kPi`
+  // queries are answered by a worker thread, one at a time, see `Work`.
+  [[noreturn]] void Serve(const char* path) {
+    const int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listener < 0) {
+      Fail("socket");
+    }
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+      errno = ENAMETOOLONG;
+      Fail(path);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (bind(listener, reinterpret_cast<const sockaddr*>(&address),
+             sizeof(address)) < 0) {
+      Fail(path);
+    }
+    if (listen(listener, SOMAXCONN) < 0) {
+      Fail("listen");
+    }
+    if (pipe2(wake_, O_NONBLOCK) < 0) {
+      Fail("pipe");
+    }
+    std::thread(&PrimeServer::Work, this).detach();
+    // The listener and the pipe the worker thread writes to when done with a
+    // job come first, `clients[i]` belongs to `fds[i + kClients]`.
+    constexpr size_t kClients = 2;
+    std::vector<pollfd> fds = {{listener, POLLIN, 0}, {wake_[0], POLLIN, 0}};
+    std::vector<Client> clients;
+    int64_t next_id = 0;
+    while (true) {
+      if (poll(fds.data(), fds.size(), -1) < 0 && errno != EINTR) {
+        Fail("poll");
+      }
+      if (fds[1].revents & POLLIN) {
+        char buffer[256];
+        while (read(wake_[0], buffer, sizeof(buffer)) > 0) {
+        }
+        std::vector<Job> done;
+        {
+          const std::lock_guard<std::mutex> lock(mutex_);
+          done.swap(done_);
+        }
+        // Fill in the answers of clients still connected, and send them once
+        // no answer before them is missing.
+        for (const Job& job : done) {
+          for (size_t i = 0; i < clients.size(); i++) {
+            Client& client = clients[i];
+            if (client.id == job.client) {
+              client.output[job.position] = job.x;
+              client.deferred.erase(std::find(client.deferred.begin(),
+                                              client.deferred.end(),
+                                              job.position));
+              fds[i + kClients].events = POLLOUT;
+            }
+          }
+        }
+      }
+      for (size_t i = fds.size() - 1; i >= kClients; i--) {
+        if (fds[i].revents != 0 && !Handle(fds[i], clients[i - kClients])) {
+          close(fds[i].fd);
+          fds.erase(fds.begin() + i);
+          clients.erase(clients.begin() + i - kClients);
+        }
+      }
+      if (fds[0].revents & POLLIN) {
+        for (int fd; (fd = accept4(listener, nullptr, nullptr,
+                                   SOCK_NONBLOCK)) >= 0;) {
+          fds.push_back({fd, POLLIN, 0});
+          clients.emplace_back().id = next_id++;
+        }
+      }
+    }
+  }
+
+ private:
+  // The state of a connection.
+  struct Client {
+    // Identifies the client to the worker thread.
+    int64_t id = 0;
+    // Received bytes that don't form a whole query yet.
+    std::vector<char> input;
+    // Answers not sent yet, starting at byte `sent`.
+    std::vector<int64_t> output;
+    size_t sent = 0;
+    // The increasing positions of answers in `output` still computed by the
+    // worker thread. Only the answers before the first one can be sent.
+    std::vector<size_t> deferred;
+  };
+
+  // A `kPi` query of a client answered by the worker thread. It replaces `x`
+  // by the answer at `position` of the client's output.
+  struct Job {
+    int64_t client;
+    size_t position;
+    int64_t x;
+  };
+
+  // Answers the jobs queued by `Handle` in order, and wakes up `Serve` with
+  // a byte written to `wake_` after each.
+  [[noreturn]] void Work() {
+    while (true) {
+      Job job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        queued_.wait(lock, [this] { return !jobs_.empty(); });
+        job = jobs_.front();
+        jobs_.pop_front();
+      }
+      job.x = PrimePi(job.x, threads_);
+      {
+        const std::lock_guard<std::mutex> lock(mutex_);
+        done_.push_back(job);
+      }
+      const char byte = 0;
+      if (write(wake_[1], &byte, 1) < 0 && errno != EAGAIN) {
+        Fail("write");
+      }
+    }
+  }
+
+  // Reads queries from a client and writes answers back. Returns false once
+  // the client disconnects.
+  bool Handle(pollfd& fd, Client& client) {
+    if (fd.revents & (POLLERR | POLLNVAL)) {
+      return false;
+    }
+    if (fd.revents & (POLLIN | POLLHUP)) {
+      char buffer[1 << 16];
+      const ssize_t received = read(fd.fd, buffer, sizeof(buffer));
+      if (received == 0 || (received < 0 && errno != EAGAIN)) {
+        return false;
+      }
+      if (received > 0) {
+        client.input.insert(client.input.end(), buffer, buffer + received);
+        const size_t whole = client.input.size() / kQuerySize * kQuerySize;
+        const size_t deferred = client.deferred.size();
+        Answer(client.input.data(), whole, client.output, &client.deferred);
+        client.input.erase(client.input.begin(), client.input.begin() + whole);
+        if (client.deferred.size() > deferred) {
+          {
+            const std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = deferred; i < client.deferred.size(); i++) {
+              const size_t position = client.deferred[i];
+              jobs_.push_back({client.id, position, client.output[position]});
+            }
+          }
+          queued_.notify_one();
+        }
+      }
+    }
+    const char* const output =
+        reinterpret_cast<const char*>(client.output.data());
+    const size_t size = (client.deferred.empty() ? client.output.size()
+                                                 : client.deferred.front()) *
+                        sizeof(int64_t);
+    while (client.sent < size) {
+      const ssize_t written = send(fd.fd, output + client.sent,
+                                   size - client.sent, MSG_NOSIGNAL);
+      if (written < 0) {
+        if (errno != EAGAIN) {
+          return false;
+        }
+        break;
+      }
+      client.sent += written;
+    }
+    if (client.sent == size && client.deferred.empty()) {
+      client.output.clear();
+      client.sent = 0;
+    }
+    // Stop reading further queries until the client catches up with reading
+    // answers, and wait for the worker thread while it can't.
+    fd.events = client.output.empty() ? POLLIN
+                : client.sent < size   ? POLLOUT
+                                       : 0;
+    return true;
+  }
+
+  const int threads_;
+  SegmentCache cache_;
+  std::vector<uint64_t> buffer_ = std::vector<uint64_t>(4096);
+  // The numbers below `kSmallPi`, sieved on the first `kPi` query below it,
+  // and the number of primes in the words of `small_` before each of them.
+  std::unique_ptr<Range> small_;
+  std::vector<int64_t> small_counts_;
+  // Jobs for the worker thread, the jobs it has done since `Serve` last took
+  // them, and the pipe it writes to after each.
+  std::mutex mutex_;
+  std::condition_variable queued_;
+  std::deque<Job> jobs_;
+  std::vector<Job> done_;
+  int wake_[2] = {-1, -1};
+};
+
+#endif  // ZILLION_PRIMES_SERVER_H_
@@ -12,154 +12,752 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-#include <bitset>
-#include <cassert>
-#include <cmath>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <span>
 #include <string>
+#include <thread>
 #include <vector>
 
-// After computing sqrt(N) initial primes, the rest is processed of chunks of
-// size `kChunkLength * Indexer::kSize`.
-// This number doesn't affect the output, but can be used to tweak
-// performance/memory consumption. Value of `50` means the chunks will occupy
-// ~256kb, which apparently works nicely for CPU caches.
-constexpr size_t kChunkLength = 50;
-
-// We store `kSize` numbers using `kBits`, excluding ones that are divisible by
-// several given smallest primes.
-constexpr struct Indexer {
-  static constexpr ptrdiff_t kSize = 2 * 3 * 5 * 7 * 11 * 13;
-  static constexpr ptrdiff_t kBits = 1 * 2 * 4 * 6 * 10 * 12;  // phi(kSize)
-  static constexpr int64_t kNextPrime = 17;
-
-  constexpr Indexer() : indexOf(), atIndex() {
-    ptrdiff_t i = 0;
-    for (int n = 0; n < kSize; n++) {
-      if ((n % 2 == 0) || (n % 3 == 0) || (n % 5 == 0) || (n % 7 == 0) ||
-          (n % 11 == 0) || (n % 13 == 0)) {
-        indexOf[n] = -1;
-      } else {
-        atIndex[i] = n;
-        indexOf[n] = i++;
+#include "factor.h"
+#include "gaps.h"
+#include "goldbach.h"
+#include "output.h"
+#include "pi.h"
+#include "presieve.h"
+#include "progressions.h"
+#include "server.h"
+#include "sieve.h"
+#include "smooth.h"
+#include "stats.h"
+#include "summatory.h"
+#include "sums.h"
+#include "tuples.h"
+
+constexpr char kUsage[] = R"(
+Emits primes up to N as 64-bit little-endian binary numbers to stdout.
+
+Usage: sieve [OPTION...] N
+
+  --output=FILE  Write primes to FILE, using io_uring where available.
+  --direct       Open FILE with O_DIRECT.
+  --positional   Write FILE in parallel, each chunk at its final position.
+  --threads=T    The number of threads to use.
+  --stats        Print statistics to stderr at the end: the time spent
+                 seeding base primes, sieving chunks, decoding and writing
+                 primes, the primes and bytes written, a histogram of the
+                 latencies of chunks and the peak memory use.
+  --reverse      Emit primes in decreasing order.
+  --from=LO      Only consider primes in [LO, N]. Works with --reverse,
+                 --tuple, --modulus, --count, --sum, --gaps, --goldbach,
+                 --factor, --spf and --smooth.
+  --limit=K      With --reverse, emit at most K primes.
+  --tuple=D,...  Emit the first primes p of prime tuples (p, p + D, ...) with
+                 all their numbers up to N instead, such as --tuple=0,2 for
+                 twin primes. Offsets must increase from 0 up to at most 64.
+                 With --count, count the tuples.
+  --modulus=Q    Together with --residue=A, emit only primes = A (mod Q),
+  --residue=A    sieving only the numbers A + Q k. With --count, count them,
+                 or without --residue, print the counts of primes in each
+                 residue class modulo Q, for Q up to 1e6.
+
+Instead of emitting primes:
+
+  --count        Print the number of primes up to N.
+  --pi           Print the number of primes up to N, computed in O(N^(2/3))
+                 time by the Lagarias-Miller-Odlyzko method.
+  --nth          Print the N-th prime, counting from 1. Uses --pi to skip
+                 most of the primes before it. N must be at most
+                 216289611853439384, the number of primes below 2^63.
+  --sum          Print the number of primes up to N, their sum and the sum of
+                 their squares, computed in O(N^(3/4)) time. N must be at
+                 most 31543762261366, so that the sums fit into 128 bits.
+  --mertens      Print the Mertens function M(N), the sum of the Moebius
+                 function up to N, computed in O(N^(2/3)) time.
+  --totients     Print the sum of Euler's totients up to N, computed in
+                 O(N^(2/3)) time.
+  --gaps         Print statistics of gaps between consecutive primes up to N:
+                 for each gap its count and first prime, then the records of
+                 maximal gaps and of their merit gap / ln(p).
+  --min-gap=G    With --gaps, consider only gaps of at least G. Above 348,
+                 gaps are found without decoding every prime.
+  --goldbach     Verify that each even number in (2, N] is a sum of two
+                 primes p + q, sieving windows in parallel. Prints lines
+                 "count P C" for the C numbers whose smallest such p is P,
+                 "record N P" for the numbers whose smallest p is larger than
+                 for all before them, and "failure N" for counterexamples,
+                 see goldbach.h.
+  --checkpoint=FILE
+                 With --goldbach, save the results so far to FILE every
+                 minute, and resume from them if FILE exists.
+
+Or, emitting 64-bit records for each number up to N instead, see factor.h:
+
+  --factor       Its factorization: the number of distinct prime factors K,
+                 followed by K pairs of a prime and its exponent.
+  --spf          Its smallest prime factor.
+
+Both sieve windows in parallel and work with --from and --output.
+
+Or, emitting candidates for smooth numbers up to N instead, see smooth.h:
+
+  --smooth=B     Numbers whose prime factors may all be at most B, found by a
+                 logarithmic sieve in parallel windows. Includes all B-smooth
+                 numbers and a few others, which the caller should rule out.
+  --slack=S      Also include numbers whose 2 log2 exceeds that of their
+                 prime factors up to B by at most S, in [0, 126]. Default 0.
+
+Works with --from and --output.
+
+Or, emitting candidates for primes among numbers of any size instead, see
+presieve.h:
+
+  --presieve=S   The offsets I in [0, L) of numbers S + I without prime
+                 factors up to N, for a decimal or 0x-prefixed hexadecimal S
+                 above N and N in [13, 2^32), sieving chunks in parallel.
+  --length=L     The length L of the window. Required with --presieve.
+
+Works with --output.
+
+Or, without N:
+
+  --serve=PATH   Answer queries about primes on a Unix domain socket at PATH,
+                 see server.h for the protocol.
+)";
+
+// What the program computes.
+enum class Mode {
+  kPrimes,
+  kCount,
+  kPi,
+  kNth,
+  kSum,
+  kMertens,
+  kTotients,
+  kGaps,
+  kGoldbach,
+  kFactor,
+  kSmallestFactor,
+  kSmooth,
+  kPresieve,
+  kServe,
+};
+
+// Command line options, as parsed by `ParseOptions`.
+struct Options {
+  Mode mode = Mode::kPrimes;
+  // The number given on the command line. In most modes it's the upper bound
+  // on primes.
+  int64_t n = -1;
+  // If non-negative, the lower bound on primes in `kCount` and `kSum` modes
+  // and with `reverse`, or on numbers in `kFactor`, `kSmallestFactor` and
+  // `kSmooth` modes.
+  int64_t from = -1;
+  // If non-empty, primes are written to this file using `UringSink` instead of
+  // stdout.
+  std::string output;
+  // Open `output` with `O_DIRECT`.
+  bool direct = false;
+  // Print `Stats` to stderr at the end.
+  bool stats = false;
+  // Write `output` in parallel using `WritePositional`.
+  bool positional = false;
+  // Emit primes in decreasing order using `EmitPrimesReverse`.
+  bool reverse = false;
+  // If non-negative, the maximum number of primes emitted with `reverse`.
+  int64_t limit = -1;
+  // If non-empty, the offsets of a `TuplePattern` to emit or count instead of
+  // primes.
+  std::vector<int64_t> tuple;
+  // If positive, primes are restricted to those `= residue (mod modulus)`, or
+  // counted for each residue class if `residue` is negative.
+  int64_t modulus = 0;
+  int64_t residue = -1;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  // The shortest gap considered in `kGaps` mode.
+  int64_t min_gap = 1;
+  // If non-empty, the file `kGoldbach` mode saves and resumes its results in.
+  std::string checkpoint;
+  // The bound on prime factors and the slack of `LogSieve` in `kSmooth` mode.
+  int64_t smooth_bound = 0;
+  int slack = 0;
+  // The start and length of the window in `kPresieve` mode.
+  BigNumber start;
+  int64_t length = -1;
+  // The socket to listen on in `kServe` mode.
+  std::string socket;
+};
+
+// Parses `argv` into `options`. Returns false on malformed arguments.
+bool ParseOptions(int argc, char* argv[], Options& options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.rfind("--", 0) != 0) {
+      if (options.n >= 0) {
+        return false;
       }
+      options.n = std::stoll(arg);
+      continue;
+    }
+    const size_t equals = arg.find('=');
+    const std::string name = arg.substr(2, equals - 2);
+    const std::string value =
+        equals == std::string::npos ? "" : arg.substr(equals + 1);
+    if (name == "output" && !value.empty()) {
+      options.output = value;
+    } else if (name == "direct" && value.empty()) {
+      options.direct = true;
+    } else if (name == "positional" && value.empty()) {
+      options.positional = true;
+    } else if (name == "stats" && value.empty()) {
+      options.stats = true;
+    } else if (name == "reverse" && value.empty()) {
+      options.reverse = true;
+    } else if (name == "limit" && !value.empty()) {
+      options.limit = std::stoll(value);
+    } else if (name == "tuple" && !value.empty()) {
+      for (size_t at = 0; at != std::string::npos;) {
+        const size_t comma = value.find(',', at);
+        options.tuple.push_back(std::stoll(value.substr(at, comma - at)));
+        at = comma == std::string::npos ? comma : comma + 1;
+      }
+      if (options.tuple.size() < 2 || options.tuple.front() != 0 ||
+          options.tuple.back() > TuplePattern::kMaxSpan ||
+          !std::is_sorted(options.tuple.begin(), options.tuple.end(),
+                          std::less_equal<int64_t>())) {
+        return false;
+      }
+    } else if (name == "modulus" && !value.empty()) {
+      options.modulus = std::stoll(value);
+    } else if (name == "residue" && !value.empty()) {
+      options.residue = std::stoll(value);
+    } else if (name == "min-gap" && !value.empty()) {
+      options.min_gap = std::stoll(value);
+    } else if (name == "checkpoint" && !value.empty()) {
+      options.checkpoint = value;
+    } else if (name == "slack" && !value.empty()) {
+      options.slack = std::stoi(value);
+    } else if (name == "length" && !value.empty()) {
+      options.length = std::stoll(value);
+    } else if (name == "from" && !value.empty()) {
+      options.from = std::stoll(value);
+    } else if (const Mode mode = name == "count"      ? Mode::kCount
+                                 : name == "pi"       ? Mode::kPi
+                                 : name == "nth"      ? Mode::kNth
+                                 : name == "sum"      ? Mode::kSum
+                                 : name == "mertens"  ? Mode::kMertens
+                                 : name == "totients" ? Mode::kTotients
+                                 : name == "gaps"     ? Mode::kGaps
+                                 : name == "goldbach" ? Mode::kGoldbach
+                                 : name == "factor"   ? Mode::kFactor
+                                 : name == "spf"      ? Mode::kSmallestFactor
+                                                      : Mode::kPrimes;
+               mode != Mode::kPrimes && value.empty()) {
+      if (options.mode != Mode::kPrimes) {
+        return false;
+      }
+      options.mode = mode;
+    } else if (name == "serve" && !value.empty()) {
+      if (options.mode != Mode::kPrimes) {
+        return false;
+      }
+      options.mode = Mode::kServe;
+      options.socket = value;
+    } else if (name == "smooth" && !value.empty()) {
+      if (options.mode != Mode::kPrimes) {
+        return false;
+      }
+      options.mode = Mode::kSmooth;
+      options.smooth_bound = std::stoll(value);
+    } else if (name == "presieve" && !value.empty()) {
+      if (options.mode != Mode::kPrimes ||
+          !ParseBigNumber(value, options.start)) {
+        return false;
+      }
+      options.mode = Mode::kPresieve;
+    } else if (name == "threads" && !value.empty()) {
+      options.threads = std::stoi(value);
+    } else {
+      return false;
     }
   }
+  return (options.mode == Mode::kServe
+              ? options.n < 0
+          : options.mode == Mode::kNth
+              ? options.n >= 1 && options.n <= kMaxNthPrime
+              : options.n >= 0) &&
+         options.threads > 0 &&
+         (!options.stats || options.mode != Mode::kServe) &&
+         (!options.direct || !options.output.empty()) &&
+         (!options.positional ||
+          (options.mode == Mode::kPrimes && !options.output.empty() &&
+           !options.direct)) &&
+         (options.mode == Mode::kPrimes || options.mode == Mode::kFactor ||
+          options.mode == Mode::kSmallestFactor ||
+          options.mode == Mode::kSmooth || options.mode == Mode::kPresieve ||
+          options.output.empty()) &&
+         (options.from < 0 || options.mode == Mode::kCount ||
+          options.mode == Mode::kSum || options.mode == Mode::kGaps ||
+          options.mode == Mode::kGoldbach || options.mode == Mode::kFactor ||
+          options.mode == Mode::kSmallestFactor ||
+          options.mode == Mode::kSmooth || options.reverse ||
+          !options.tuple.empty() || options.modulus > 0) &&
+         (options.tuple.empty() ||
+          (options.mode == Mode::kCount ||
+           (options.mode == Mode::kPrimes && !options.positional &&
+            !options.reverse))) &&
+         (!options.reverse ||
+          (options.mode == Mode::kPrimes && !options.positional)) &&
+         (options.limit < 0 || options.reverse) &&
+         (options.min_gap == 1 ||
+          (options.mode == Mode::kGaps && options.min_gap >= 1)) &&
+         (options.checkpoint.empty() || options.mode == Mode::kGoldbach) &&
+         (options.mode != Mode::kSmooth || options.smooth_bound >= 1) &&
+         (options.mode != Mode::kSum || options.n <= kMaxPrimeSums) &&
+         (options.mode == Mode::kPresieve
+              ? options.length >= 0 && options.n >= kMinPresieveBound &&
+                    options.n <= UINT32_MAX &&
+                    BigNumberAbove(options.start, options.n)
+              : options.length < 0) &&
+         (options.slack == 0 ||
+          (options.mode == Mode::kSmooth && options.slack > 0 &&
+           options.slack <= 126)) &&
+         options.modulus >= 0 &&
+         (options.modulus == 0
+              ? options.residue < 0
+              : options.residue < options.modulus && options.tuple.empty() &&
+                    (options.residue >= 0 ||
+                     options.modulus <= kMaxResidueModulus) &&
+                    (options.mode == Mode::kCount ||
+                     (options.mode == Mode::kPrimes && options.residue >= 0 &&
+                      !options.positional && !options.reverse)));
+}
 
-  ptrdiff_t indexOf[kSize];
-  int64_t atIndex[kBits];
-} kIndexer;
+// Passes all primes up to `maximum` in increasing order to `sink.Put`.
+template <typename Sink>
+void EmitPrimes(const int64_t maximum, Sink& sink) {
+  for (const int64_t p : kWheelPrimes) {
+    if (p > maximum) {
+      return;
+    }
+    sink.Put(p);
+  }
+  // `primes` will hold all primes up to `primes.end()`, which are emitted
+  // while they're being discovered.
+  const BasePrimes primes(maximum, [maximum, &sink](const int64_t p) {
+    if (p <= maximum) {
+      sink.Put(p);
+    }
+  });
+  // This loop can be easily parallelized to utilize all cores, if desired.
+  std::vector<uint64_t> buffer(4096);
+  ForPrimeBatchesBetween(primes, primes.end(), maximum, std::span(buffer),
+                         [&sink](const std::span<const uint64_t> batch) {
+                           sink.Put(batch);
+                         });
+}
+
+// Passes primes in [lo, hi] in decreasing order to `sink.Put`, at most `limit`
+// of them unless it's negative.
+template <typename Sink>
+void EmitPrimesReverse(const int64_t lo, const int64_t hi, int64_t limit,
+                       Sink& sink) {
+  std::vector<uint64_t> buffer(4096);
+  ForPrimeBatchesBetweenReverse(
+      BasePrimes(hi), lo, hi, std::span(buffer),
+      [&limit, &sink](std::span<const uint64_t> batch) {
+        if (limit >= 0 && static_cast<int64_t>(batch.size()) >= limit) {
+          sink.Put(batch.first(limit));
+          return false;
+        }
+        limit -= batch.size();
+        sink.Put(batch);
+        return true;
+      });
+}
+
+// Passes the first primes of tuples of `pattern` in [lo, hi] in increasing
+// order to `sink.Put`.
+template <typename Sink>
+void EmitTuples(const TuplePattern& pattern, const int64_t lo,
+                const int64_t hi, Sink& sink) {
+  std::vector<uint64_t> buffer(4096);
+  ForTupleBatchesBetween(BasePrimes(hi), pattern, lo, hi, std::span(buffer),
+                         [&sink](const std::span<const uint64_t> batch) {
+                           sink.Put(batch);
+                         });
+}
+
+// Passes primes `= residue (mod modulus)` in [lo, hi] in increasing order to
+// `sink.Put`.
+template <typename Sink>
+void EmitPrimesInProgression(const int64_t modulus, const int64_t residue,
+                             const int64_t lo, const int64_t hi, Sink& sink) {
+  std::vector<uint64_t> buffer;
+  buffer.reserve(4096);
+  ForPrimesInProgression(modulus, residue, lo, hi,
+                         [&buffer, &sink](const int64_t p) {
+                           buffer.push_back(p);
+                           if (buffer.size() == buffer.capacity()) {
+                             sink.Put(buffer);
+                             buffer.clear();
+                           }
+                         });
+  sink.Put(buffer);
+}
 
-// Computes `-x mod p`.
-constexpr int64_t MinusMod(int64_t x, int64_t p) {
-  return p - 1 - (x + p - 1) % p;
+// Passes records of all numbers in [lo, hi] to `sink.Put`, either
+// factorizations or, with `smallest`, smallest prime factors.
+template <typename Sink>
+void EmitFactors(const bool smallest, const int64_t lo, const int64_t hi,
+                 const int threads, Sink& sink) {
+  auto put = [&sink](const std::span<const uint64_t> records) {
+    sink.Put(records);
+  };
+  if (smallest) {
+    ForSmallestFactors(lo, hi, threads, put);
+  } else {
+    ForFactorizations(lo, hi, threads, put);
+  }
 }
 
-// Represents a sieved range of `size * Indexer::kSize` numbers starting at
-// `offset`.
-class Range {
- public:
-  Range(int64_t offset, int64_t size)
-      : offset_(offset), max_(size * Indexer::kSize), bitsets_(size) {
-    if (offset == 0) {  // We don't consider 1 to be a prime.
-      bitsets_[0].set(0);
+// Writes `stats` to `path`, replacing it only once complete.
+void SaveGoldbachStats(const std::string& path, const GoldbachStats& stats) {
+  const std::string temporary = path + ".tmp";
+  {
+    std::ofstream out(temporary);
+    WriteGoldbachStats(out, stats);
+    if (!out.flush()) {
+      Fail(temporary.c_str());
     }
   }
+  if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+    Fail(path.c_str());
+  }
+}
 
-  void Sieve(const int64_t p) { Sieve(p, MinusMod(offset_, p)); }
-  void Sieve(const int64_t p, int64_t offset) {
-    for (; offset < max_; offset += p) {
-      const ptrdiff_t index = kIndexer.indexOf[offset % Indexer::kSize];
-      if (index >= 0) {
-        bitsets_[offset / Indexer::kSize].set(index);
-      }
+// Verifies the even numbers in [lo, hi] and prints the results as described
+// in `kUsage`. With a non-empty `checkpoint`, resumes from the results saved
+// there, if any, and saves them there every minute and at the end.
+void PrintGoldbach(const int64_t lo, const int64_t hi, const int threads,
+                   const std::string& checkpoint) {
+  GoldbachStats stats;
+  stats.lo = lo;
+  stats.hi = lo - 1;
+  if (std::ifstream in(checkpoint); !checkpoint.empty() && in) {
+    if (!ReadGoldbachStats(in, stats) || stats.lo != lo || stats.hi > hi) {
+      std::cerr << checkpoint << ": not a checkpoint of [" << lo << ", " << hi
+                << "]" << std::endl;
+      std::exit(1);
     }
   }
+  auto saved = std::chrono::steady_clock::now();
+  ForGoldbachWindows(BasePrimes(hi), stats.hi + 1, hi, threads,
+                     [&](const GoldbachStats& window) {
+                       stats.Append(window);
+                       const auto now = std::chrono::steady_clock::now();
+                       if (!checkpoint.empty() &&
+                           now - saved >= std::chrono::minutes(1)) {
+                         SaveGoldbachStats(checkpoint, stats);
+                         saved = now;
+                       }
+                     });
+  if (!checkpoint.empty()) {
+    SaveGoldbachStats(checkpoint, stats);
+  }
+  WriteGoldbachStats(std::cout, stats);
+}
 
-  // Runs a given function for all numbers in the range that are marked as
-  // primes.
-  template <typename F>
-  void ForPrimes(F&& f) const {
-    for (ptrdiff_t j = 0; j < bitsets_.size(); j++) {
-      auto& bitset = bitsets_[j];
-      const int64_t offset = j * Indexer::kSize;
-      for (ptrdiff_t index = 0; index < Indexer::kBits; index++) {
-        if (!bitset[index]) {
-          f(offset + kIndexer.atIndex[index]);
-        }
-      }
+// Passes the candidates for `bound`-smooth numbers in [lo, hi] to `sink.Put`.
+template <typename Sink>
+void EmitSmoothCandidates(const int64_t bound, const int slack,
+                          const int64_t lo, const int64_t hi, const int threads,
+                          Sink& sink) {
+  ForSmoothCandidates(lo, hi, bound, slack, /*powers=*/true, threads,
+                      [&sink](const std::span<const uint64_t> candidates) {
+                        sink.Put(candidates);
+                      });
+}
+
+// Passes the offsets `i` in [0, length) of numbers `start + i` without prime
+// factors up to `bound` to `sink.Put`.
+template <typename Sink>
+void EmitPresieveSurvivors(const BigNumber& start, const int64_t length,
+                           const int64_t bound, const int threads,
+                           Sink& sink) {
+  ForPresieveSurvivors(start, length, bound, threads,
+                       [&sink](const std::span<const uint64_t> offsets) {
+                         sink.Put(offsets);
+                       });
+}
+
+// Prints `stats` as described in `kUsage`.
+void PrintGaps(const GapStats& stats) {
+  std::cout << "# gap count first\n";
+  for (size_t g = 0; g < stats.counts.size(); g++) {
+    if (stats.counts[g] > 0) {
+      std::cout << g << ' ' << stats.counts[g] << ' ' << stats.firsts[g]
+                << '\n';
     }
   }
+  std::cout << "# maximal: prime gap\n";
+  for (const PrimeGap& gap : stats.maximal) {
+    std::cout << gap.prime << ' ' << gap.length << '\n';
+  }
+  std::cout << "# merit: prime gap merit\n";
+  for (const PrimeGap& gap : stats.merit) {
+    std::cout << gap.prime << ' ' << gap.length << ' ' << gap.merit() << '\n';
+  }
+  std::cout << std::flush;
+}
 
- private:
-  const int64_t offset_;
-  // The number of numbers represented by this range.
-  const int64_t max_;
-  std::vector<std::bitset<Indexer::kBits>> bitsets_;
-};
+// Writes `size` bytes of primes from `data` into `fd` at `offset`.
+void PositionalWrite(int fd, const char* data, size_t size, off_t offset) {
+  const ScopedPhase phase(Phase::kWrite);
+  Stats::AddOutput(size / 8, size);
+  while (size > 0) {
+    const ssize_t written = pwrite(fd, data, size, offset);
+    if (written < 0) {
+      Fail("pwrite");
+    }
+    data += written;
+    size -= written;
+    offset += written;
+  }
+}
+
+// Writes all primes up to `maximum` into a file at `path` using `threads`
+// threads.
+//
+// In the 64-bit format the position of each prime in the file is given by its
+// index. So in the first pass, chunks are sieved in parallel just to count
+// their primes. After prefix-summing the counts, the file is preallocated and
+// in the second pass every chunk is sieved again and its primes are written
+// with `pwrite` directly at their final offset. Threads never wait for each
+// other, there is no ordering between the chunks.
+void WritePositional(const int64_t maximum, const char* path,
+                     const int threads) {
+  // The primes before the first chunk are collected into `head`.
+  std::vector<char> head;
+  auto put = [maximum, &head](const int64_t p) {
+    if (p <= maximum) {
+      head.resize(head.size() + 8);
+      EncodeLittleEndian(p, head.data() + head.size() - 8);
+    }
+  };
+  for (const int64_t p : kWheelPrimes) {
+    put(p);
+  }
+  const BasePrimes primes(maximum, put);
+  const int64_t initial_end = primes.end();
+  const int64_t chunk_count = ChunkCount(initial_end, maximum);
+  auto sieve = [&primes, initial_end](const int64_t chunk) {
+    return SieveChunk(primes, initial_end, chunk);
+  };
+  // `offsets[chunk]` is the index of the first prime of `chunk`.
+  std::vector<int64_t> offsets(chunk_count + 1);
+  offsets[0] = head.size() / 8;
+  ParallelFor(threads, chunk_count, [&](const int64_t chunk) {
+    const Range range = sieve(chunk);
+    if (chunk + 1 < chunk_count) {
+      offsets[chunk + 1] = range.Count();
+    } else {
+      int64_t count = 0;
+      range.ForPrimes([&count, &range, maximum](const int64_t x) {
+        count += x + range.offset() <= maximum;
+      });
+      offsets[chunk + 1] = count;
+    }
+  });
+  for (int64_t chunk = 0; chunk < chunk_count; chunk++) {
+    offsets[chunk + 1] += offsets[chunk];
+  }
 
-// Outputs `p` to stdout as a 64-bit little-endian number.
-void PrintLittleEndian(int64_t p) {
-  char out[8];
-  for (size_t i = 0; i < 8; i++) {
-    out[i] = p & 0xff;
-    p >>= 8;
+  const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    Fail(path);
+  }
+  if (offsets[chunk_count] > 0) {
+    if (const int error = posix_fallocate(fd, 0, offsets[chunk_count] * 8)) {
+      errno = error;
+      Fail("posix_fallocate");
+    }
+  }
+  PositionalWrite(fd, head.data(), head.size(), 0);
+  ParallelFor(threads, chunk_count, [&](const int64_t chunk) {
+    const Range range = sieve(chunk);
+    std::vector<char> buffer((offsets[chunk + 1] - offsets[chunk]) * 8);
+    {
+      const ScopedPhase phase(Phase::kDecode);
+      char* out = buffer.data();
+      char* const end = out + buffer.size();
+      // The buffer only takes the primes up to `maximum`.
+      std::vector<uint64_t> primes(4096);
+      range.ForPrimeBatches(
+          primes, [&out, end](const std::span<const uint64_t> batch) {
+            for (const uint64_t p : batch.first(
+                     std::min<size_t>(batch.size(), (end - out) / 8))) {
+              EncodeLittleEndian(p, out);
+              out += 8;
+            }
+          });
+    }
+    PositionalWrite(fd, buffer.data(), buffer.size(), offsets[chunk] * 8);
+  });
+  if (close(fd) < 0) {
+    Fail(path);
   }
-  fwrite(&out, sizeof(out), 1, stdout);
 }
 
 int main(int argc, char* argv[]) {
-  if (argc != 2) {
-    std::cerr
-        << "Emits primes as 64-bit little-endian binary numbers to stdout."
-        << std::endl
-        << std::endl;
-    std::cerr << "Please specify an upper bound as the only parameter."
-              << std::endl;
+  Options options;
+  if (!ParseOptions(argc, argv, options)) {
+    std::cerr << kUsage + 1;
     return 1;
   }
-  const int64_t maximum = std::stoll(argv[1]);
-  // The number of `Indexer::kSize` pieces we need to represent all primes
-  // <= sqrt(maximum).
-  const size_t initial_length = static_cast<size_t>(
-      std::ceil(std::sqrt(static_cast<long double>(maximum)) / Indexer::kSize));
-  for (int i : {2, 3, 5, 7, 11, 13}) {
-    if (i > maximum) {
-      exit(0);
+  if (options.stats) {
+    Stats::Enable();
+  }
+  switch (options.mode) {
+    case Mode::kCount:
+      if (options.modulus > 0 && options.residue >= 0) {
+        std::cout << CountPrimesInProgression(options.modulus, options.residue,
+                                              options.from, options.n,
+                                              options.threads)
+                  << std::endl;
+        break;
+      }
+      if (options.modulus > 0) {
+        const std::vector<int64_t> counts = CountPrimesByResidue(
+            options.modulus, options.from, options.n, options.threads);
+        for (int64_t r = 0; r < options.modulus; r++) {
+          std::cout << r << ' ' << counts[r] << '\n';
+        }
+        break;
+      }
+      if (!options.tuple.empty()) {
+        std::cout << CountTuples(BasePrimes(options.n),
+                                 TuplePattern(options.tuple), options.from,
+                                 options.n, options.threads)
+                  << std::endl;
+        break;
+      }
+      std::cout << CountPrimes(std::max<int64_t>(options.from, 0), options.n,
+                               options.threads)
+                << std::endl;
+      break;
+    case Mode::kPi:
+      std::cout << PrimePi(options.n, options.threads) << std::endl;
+      break;
+    case Mode::kNth:
+      std::cout << NthPrime(options.n, options.threads) << std::endl;
+      break;
+    case Mode::kSum: {
+      const PrimeSums sums =
+          options.from < 0
+              ? SumPrimes(options.n)
+              : SumPrimes(options.from, options.n, options.threads);
+      std::cout << sums.count << ' ' << ToString(sums.sum) << ' '
+                << ToString(sums.sum_of_squares) << std::endl;
+      break;
     }
-    PrintLittleEndian(i);
-  }
-  // `primes` will hold all primes up to `initial_end`.
-  const int64_t initial_end = initial_length * Indexer::kSize;
-  assert(initial_end * initial_end >= maximum);
-  Range primes(0, initial_length);
-  // Seed the initial range of primes. It is OK to run the `ForPrimes` loop and
-  // rune `primes.Sieve` inside it - primes are processed while they're
-  // generated.
-  primes.ForPrimes([maximum, &primes](const int64_t p) {
-    if (p > maximum) {
-      exit(0);
+    case Mode::kMertens:
+      std::cout << Mertens(options.n, options.threads) << std::endl;
+      break;
+    case Mode::kTotients:
+      std::cout << ToString(SumTotients(options.n, options.threads))
+                << std::endl;
+      break;
+    case Mode::kGaps:
+      PrintGaps(PrimeGaps(options.from, options.n, options.min_gap,
+                          options.threads));
+      break;
+    case Mode::kGoldbach:
+      PrintGoldbach(std::max<int64_t>(options.from, 0), options.n,
+                    options.threads, options.checkpoint);
+      break;
+    case Mode::kFactor:
+    case Mode::kSmallestFactor: {
+      const bool smallest = options.mode == Mode::kSmallestFactor;
+      if (options.output.empty()) {
+        StdoutSink sink;
+        EmitFactors(smallest, options.from, options.n, options.threads, sink);
+      } else {
+        UringSink sink(options.output.c_str(), options.direct);
+        EmitFactors(smallest, options.from, options.n, options.threads, sink);
+      }
+      break;
     }
-    PrintLittleEndian(p);
-    primes.Sieve(p, Indexer::kNextPrime * p);
-  });
-  // This loop can be easily parallelized to utilize all cores, if desired.
-  constexpr size_t kChunkSize = Indexer::kSize * kChunkLength;
-  const size_t chunk_count =
-      (maximum - initial_end + kChunkSize - 1) / kChunkSize;
-  for (int64_t chunk = 0; chunk < chunk_count; chunk++) {
-    const int64_t offset = initial_end + chunk * kChunkSize;
-    Range range(offset, kChunkLength);
-    primes.ForPrimes([&range](const int64_t p) { range.Sieve(p); });
-    range.ForPrimes([offset, maximum](const int64_t x) {
-      const int64_t p = x + offset;
-      if (p > maximum) {
-        exit(0);
+    case Mode::kSmooth:
+      if (options.output.empty()) {
+        StdoutSink sink;
+        EmitSmoothCandidates(options.smooth_bound, options.slack, options.from,
+                             options.n, options.threads, sink);
+      } else {
+        UringSink sink(options.output.c_str(), options.direct);
+        EmitSmoothCandidates(options.smooth_bound, options.slack, options.from,
+                             options.n, options.threads, sink);
+      }
+      break;
+    case Mode::kPresieve:
+      if (options.output.empty()) {
+        StdoutSink sink;
+        EmitPresieveSurvivors(options.start, options.length, options.n,
+                              options.threads, sink);
+      } else {
+        UringSink sink(options.output.c_str(), options.direct);
+        EmitPresieveSurvivors(options.start, options.length, options.n,
+                              options.threads, sink);
+      }
+      break;
+    case Mode::kServe:
+      PrimeServer(options.threads).Serve(options.socket.c_str());
+      break;
+    case Mode::kPrimes:
+      if (options.positional) {
+        WritePositional(options.n, options.output.c_str(), options.threads);
+      } else if (options.output.empty()) {
+        StdoutSink sink;
+        if (options.reverse) {
+          EmitPrimesReverse(options.from, options.n, options.limit, sink);
+        } else if (!options.tuple.empty()) {
+          EmitTuples(TuplePattern(options.tuple), options.from, options.n,
+                     sink);
+        } else if (options.modulus > 0) {
+          EmitPrimesInProgression(options.modulus, options.residue,
+                                  options.from, options.n, sink);
+        } else {
+          EmitPrimes(options.n, sink);
+        }
+      } else {
+        UringSink sink(options.output.c_str(), options.direct);
+        if (options.reverse) {
+          EmitPrimesReverse(options.from, options.n, options.limit, sink);
+        } else if (!options.tuple.empty()) {
+          EmitTuples(TuplePattern(options.tuple), options.from, options.n,
+                     sink);
+        } else if (options.modulus > 0) {
+          EmitPrimesInProgression(options.modulus, options.residue,
+                                  options.from, options.n, sink);
+        } else {
+          EmitPrimes(options.n, sink);
+        }
       }
-      PrintLittleEndian(p);
-    });
+      break;
+  }
+  if (options.stats) {
+    Stats::Report(std::cerr);
   }
   return 0;
 }
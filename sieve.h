@@ -0,0 +1,901 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// The prime sieve as a library. All primes in a given interval can be computed
+// by `ForPrimesBetween` and counted by `CountPrimes`. Both reuse the building
+// blocks below, which can be combined to drive the sieve directly.
+
+#ifndef ZILLION_PRIMES_SIEVE_H_
+#define ZILLION_PRIMES_SIEVE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <span>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "primality.h"
+#include "stats.h"
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+// After computing sqrt(N) initial primes, the rest is processed of chunks of
+// size `kChunkLength * Indexer::kSize`.
+// This number doesn't affect the output, but can be used to tweak
+// performance/memory consumption. Value of `50` means the chunks will occupy
+// ~256kb, which apparently works nicely for CPU caches.
+constexpr size_t kChunkLength = 50;
+
+// We store `kSize` numbers using `kBits`, excluding ones that are divisible by
+// several given smallest primes.
+inline constexpr struct Indexer {
+  static constexpr ptrdiff_t kSize = 2 * 3 * 5 * 7 * 11 * 13;
+  static constexpr ptrdiff_t kBits = 1 * 2 * 4 * 6 * 10 * 12;  // phi(kSize)
+  static constexpr int64_t kNextPrime = 17;
+
+  constexpr Indexer() : indexOf(), atIndex() {
+    ptrdiff_t i = 0;
+    for (int n = 0; n < kSize; n++) {
+      if ((n % 2 == 0) || (n % 3 == 0) || (n % 5 == 0) || (n % 7 == 0) ||
+          (n % 11 == 0) || (n % 13 == 0)) {
+        indexOf[n] = -1;
+      } else {
+        atIndex[i] = n;
+        indexOf[n] = i++;
+      }
+    }
+  }
+
+  ptrdiff_t indexOf[kSize];
+  int64_t atIndex[kBits];
+} kIndexer;
+
+// Computes `-x mod p` for `x >= 0`, without overflowing for any `x`.
+constexpr int64_t MinusMod(int64_t x, int64_t p) {
+  const int64_t r = x % p;
+  return r == 0 ? 0 : p - r;
+}
+
+#if defined(__AVX2__) && !defined(__AVX512F__)
+// For each 4-bit mask, the indices of 32-bit lanes that move the selected
+// 64-bit lanes of a vector to its front, for `_mm256_permutevar8x32_epi32`.
+inline constexpr struct CompressTable {
+  constexpr CompressTable() : lanes() {
+    for (int mask = 0; mask < 16; mask++) {
+      int j = 0;
+      for (int i = 0; i < 4; i++) {
+        if (mask & (1 << i)) {
+          lanes[mask][j++] = 2 * i;
+          lanes[mask][j++] = 2 * i + 1;
+        }
+      }
+    }
+  }
+
+  alignas(32) int32_t lanes[16][8];
+} kCompressTable;
+#endif
+
+// Writes `offset + at[i]` for each bit `i` set in `bits` to `out` in
+// increasing order, and returns the end of the written values.
+//
+// With AVX-512 each group of 8 bits is converted by a single `VPCOMPRESSQ`,
+// with AVX2 each group of 4 bits by a permutation from `kCompressTable`. Both
+// store whole vectors, so up to 64 values past `out` may be overwritten.
+inline uint64_t* DecodeWord(uint64_t bits, const int64_t* at,
+                            const uint64_t offset, uint64_t* out) {
+#if defined(__AVX512F__)
+  const __m512i base = _mm512_set1_epi64(offset);
+  for (; bits != 0; bits >>= 8, at += 8) {
+    const __mmask8 mask = bits & 0xff;
+    const __m512i values = _mm512_add_epi64(_mm512_loadu_si512(at), base);
+    _mm512_storeu_si512(out, _mm512_maskz_compress_epi64(mask, values));
+    out += std::popcount(mask);
+  }
+#elif defined(__AVX2__)
+  const __m256i base = _mm256_set1_epi64x(offset);
+  for (; bits != 0; bits >>= 4, at += 4) {
+    const unsigned mask = bits & 0xf;
+    const __m256i values = _mm256_add_epi64(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(at)), base);
+    const __m256i lanes = _mm256_load_si256(
+        reinterpret_cast<const __m256i*>(kCompressTable.lanes[mask]));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out),
+                        _mm256_permutevar8x32_epi32(values, lanes));
+    out += std::popcount(mask);
+  }
+#else
+  for (; bits != 0; bits &= bits - 1) {
+    *out++ = offset + at[std::countr_zero(bits)];
+  }
+#endif
+  return out;
+}
+
+// Represents a sieved range of `size * Indexer::kSize` numbers starting at
+// `offset`.
+//
+// Each piece of `Indexer::kSize` numbers is stored in `kWords` consecutive
+// words. Bit `i` of word `j` is set if the number at relative offset
+// `j / kWords * Indexer::kSize + kIndexer.atIndex[j % kWords * 64 + i]` is
+// composite. So the bits of all words, in order, correspond to the increasing
+// sequence of numbers in the range not divisible by `kWheelPrimes`.
+class Range {
+ public:
+  static_assert(Indexer::kBits % 64 == 0);
+  static constexpr ptrdiff_t kWords = Indexer::kBits / 64;
+
+  Range(int64_t offset, int64_t size)
+      : offset_(offset), max_(size * Indexer::kSize), words_(size * kWords) {
+    if (offset == 0 && size > 0) {  // We don't consider 1 to be a prime.
+      words_[0] |= 1;
+    }
+  }
+
+  // The first number of the range.
+  int64_t offset() const { return offset_; }
+  // The number of numbers represented by this range.
+  int64_t size() const { return max_; }
+  // The bits of the range as described above.
+  const std::vector<uint64_t>& words() const { return words_; }
+
+  // Marks all multiples of `p` in the range, except `p` itself. Multiples
+  // below `p * p` have smaller factors, so they're skipped.
+  void Sieve(const int64_t p) {
+    // `p * p` may not fit into `int64_t` for the largest base primes.
+    Sieve(p, offset_ / p >= p
+                 ? MinusMod(offset_, p)
+                 : std::min<uint64_t>(static_cast<uint64_t>(p) * p - offset_,
+                                      max_));
+  }
+  // Marks numbers `offset`, `offset + p`, ... relative to the start of the
+  // range.
+  void Sieve(const int64_t p, int64_t offset) {
+    for (; offset < max_; offset += p) {
+      const ptrdiff_t index = kIndexer.indexOf[offset % Indexer::kSize];
+      if (index >= 0) {
+        words_[offset / Indexer::kSize * kWords + index / 64] |=
+            uint64_t{1} << (index % 64);
+      }
+    }
+  }
+
+  // Returns whether the number at relative offset `x` is marked as a prime.
+  // Numbers divisible by `kWheelPrimes` never are.
+  bool IsPrime(const int64_t x) const {
+    const ptrdiff_t index = kIndexer.indexOf[x % Indexer::kSize];
+    return index >= 0 &&
+           !(words_[x / Indexer::kSize * kWords + index / 64] >> (index % 64) &
+             1);
+  }
+
+  // Returns the smallest relative offset >= `x` of a number marked as a prime,
+  // or `size()` if there is none.
+  int64_t NextPrime(const int64_t x) const {
+    if (x >= max_) {
+      return max_;
+    }
+    // Find the bit of the first number >= `x` not divisible by `kWheelPrimes`.
+    int64_t row = x / Indexer::kSize;
+    int64_t r = x % Indexer::kSize;
+    while (r < Indexer::kSize && kIndexer.indexOf[r] < 0) {
+      r++;
+    }
+    const int64_t bit =
+        r < Indexer::kSize ? row * Indexer::kBits + kIndexer.indexOf[r]
+                           : (row + 1) * Indexer::kBits;
+    uint64_t mask = ~uint64_t{0} << (bit % 64);
+    for (size_t j = bit / 64; j < words_.size(); j++, mask = ~uint64_t{0}) {
+      if (const uint64_t bits = ~words_[j] & mask; bits != 0) {
+        return j / kWords * Indexer::kSize +
+               kIndexer.atIndex[j % kWords * 64 + std::countr_zero(bits)];
+      }
+    }
+    return max_;
+  }
+
+  // Returns the largest relative offset <= `x` of a number marked as a prime,
+  // or -1 if there is none.
+  int64_t PrevPrime(const int64_t x) const {
+    if (x < 0) {
+      return -1;
+    }
+    if (x >= max_) {
+      return PrevPrime(max_ - 1);
+    }
+    // Find the bit of the last number <= `x` not divisible by `kWheelPrimes`.
+    const int64_t row = x / Indexer::kSize;
+    int64_t r = x % Indexer::kSize;
+    while (r >= 0 && kIndexer.indexOf[r] < 0) {
+      r--;
+    }
+    const int64_t bit = r >= 0 ? row * Indexer::kBits + kIndexer.indexOf[r]
+                               : row * Indexer::kBits - 1;
+    if (bit < 0) {
+      return -1;
+    }
+    uint64_t mask = ~uint64_t{0} >> (63 - bit % 64);
+    for (int64_t j = bit / 64; j >= 0; j--, mask = ~uint64_t{0}) {
+      if (const uint64_t bits = ~words_[j] & mask; bits != 0) {
+        return j / kWords * Indexer::kSize +
+               kIndexer.atIndex[j % kWords * 64 + 63 - std::countl_zero(bits)];
+      }
+    }
+    return -1;
+  }
+
+  // Returns the number of numbers in the range that are marked as primes.
+  int64_t Count() const {
+    int64_t count = 0;
+    for (const uint64_t word : words_) {
+      count += std::popcount(~word);
+    }
+    return count;
+  }
+
+  // Runs a given function for all numbers in the range that are marked as
+  // primes. If `end` is given, numbers in rows starting at relative offset
+  // `end` or above are skipped.
+  template <typename F>
+  void ForPrimes(F&& f, const int64_t end = std::numeric_limits<int64_t>::max())
+      const {
+    const size_t words = std::min<size_t>(
+        words_.size(), (end - 1) / Indexer::kSize * kWords + kWords);
+    for (size_t j = 0; j < words; j++) {
+      const int64_t offset = j / kWords * Indexer::kSize;
+      const int64_t* at = &kIndexer.atIndex[j % kWords * 64];
+      // Re-read the word after each call, `f` may sieve the range further.
+      for (uint64_t bits = ~words_[j]; bits != 0;) {
+        const int index = std::countr_zero(bits);
+        f(offset + at[index]);
+        bits = ~words_[j] & ((~uint64_t{0} << index) << 1);
+      }
+    }
+  }
+
+  // Decodes all numbers in the range that are marked as primes into `buffer`
+  // as absolute values, that is, with `offset()` added. Calls `f` with a
+  // `std::span<const uint64_t>` batch of them whenever `buffer` can't take
+  // another word of bits, and once more at the end if anything remains.
+  // `buffer` must hold at least 64 values.
+  template <typename F>
+  void ForPrimeBatches(const std::span<uint64_t> buffer, F&& f) const {
+    assert(buffer.size() >= 64);
+    const ScopedPhase phase(Phase::kDecode);
+    uint64_t* out = buffer.data();
+    uint64_t* const last = buffer.data() + buffer.size() - 64;
+    for (size_t j = 0; j < words_.size(); j++) {
+      if (out > last) {
+        f(std::span<const uint64_t>(buffer.data(), out));
+        out = buffer.data();
+      }
+      out = DecodeWord(~words_[j], &kIndexer.atIndex[j % kWords * 64],
+                       offset_ + j / kWords * Indexer::kSize, out);
+    }
+    if (out != buffer.data()) {
+      f(std::span<const uint64_t>(buffer.data(), out));
+    }
+  }
+
+  // Like `ForPrimeBatches`, but calls `f` with batches in decreasing order,
+  // each of them sorted in decreasing order too. Groups of words are decoded
+  // from the end of the range, and each batch is reversed before passing it
+  // on, which is much faster than scanning bits one by one backwards. If `f`
+  // returns `bool`, stops as soon as it returns false, and then returns false
+  // too.
+  template <typename F>
+  bool ForPrimeBatchesReverse(const std::span<uint64_t> buffer, F&& f) const {
+    assert(buffer.size() >= 64);
+    const ScopedPhase phase(Phase::kDecode);
+    const size_t group = buffer.size() / 64;
+    for (size_t end = words_.size(); end > 0;) {
+      const size_t begin = end > group ? end - group : 0;
+      uint64_t* out = buffer.data();
+      for (size_t j = begin; j < end; j++) {
+        out = DecodeWord(~words_[j], &kIndexer.atIndex[j % kWords * 64],
+                         offset_ + j / kWords * Indexer::kSize, out);
+      }
+      std::reverse(buffer.data(), out);
+      const std::span<const uint64_t> batch(buffer.data(), out);
+      if constexpr (std::is_same_v<
+                        std::invoke_result_t<F&, std::span<const uint64_t>>,
+                        bool>) {
+        if (!batch.empty() && !f(batch)) {
+          return false;
+        }
+      } else if (!batch.empty()) {
+        f(batch);
+      }
+      end = begin;
+    }
+    return true;
+  }
+
+ private:
+  const int64_t offset_;
+  // The number of numbers represented by this range.
+  const int64_t max_;
+  std::vector<uint64_t> words_;
+};
+
+// Runs `f(i)` for all `i` in [0, count) using `threads` threads. Indices are
+// handed out in increasing order, but may complete in any order. If `f` also
+// accepts the index of the running thread in [0, threads) as the second
+// argument, it's passed too. This allows accumulating results per thread.
+template <typename F>
+void ParallelFor(int threads, int64_t count, F&& f) {
+  std::atomic<int64_t> next(0);
+  auto worker = [&next, count, &f](const int thread) {
+    for (int64_t i; (i = next.fetch_add(1)) < count;) {
+      if constexpr (std::is_invocable_v<F&, int64_t, int>) {
+        f(i, thread);
+      } else {
+        f(i);
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (int t = 1; t < threads; t++) {
+    pool.emplace_back(worker, t);
+  }
+  worker(0);
+  for (auto& thread : pool) {
+    thread.join();
+  }
+}
+
+// Primes not represented by `Indexer`.
+inline constexpr int64_t kWheelPrimes[] = {2, 3, 5, 7, 11, 13};
+
+// The largest prime that fits into `int64_t`, 2^63 - 25.
+inline constexpr int64_t kLargestPrime =
+    std::numeric_limits<int64_t>::max() - 24;
+
+// Returns a range starting at 0 that holds at least all primes up to
+// `sqrt(maximum)`, and calls `f` for each of its primes (but not for the
+// primes below `Indexer::kNextPrime`, which it doesn't represent).
+template <typename F>
+Range SeedPrimes(const int64_t maximum, F&& f) {
+  const ScopedPhase phase(Phase::kSeed);
+  // The number of `Indexer::kSize` pieces we need to represent all primes
+  // <= sqrt(maximum).
+  const size_t initial_length = static_cast<size_t>(
+      std::ceil(std::sqrt(static_cast<long double>(maximum)) / Indexer::kSize));
+  assert(static_cast<uint64_t>(initial_length * Indexer::kSize) *
+             static_cast<uint64_t>(initial_length * Indexer::kSize) >=
+         static_cast<uint64_t>(maximum));
+  Range primes(0, initial_length);
+  // It is OK to run the `ForPrimes` loop and rune `primes.Sieve` inside it -
+  // primes are processed while they're generated.
+  primes.ForPrimes([&primes, &f](const int64_t p) {
+    f(p);
+    primes.Sieve(p, Indexer::kNextPrime * p);
+  });
+  return primes;
+}
+
+constexpr size_t kChunkSize = Indexer::kSize * kChunkLength;
+
+// Returns the number of chunks of `kChunkSize` needed to cover all numbers
+// from `initial_end` up to `maximum`.
+inline int64_t ChunkCount(const int64_t initial_end, const int64_t maximum) {
+  return maximum > initial_end
+             ? (maximum - initial_end + kChunkSize - 1) / kChunkSize
+             : 0;
+}
+
+// Holds the primes needed to sieve any range up to a given maximum.
+class BasePrimes {
+ public:
+  explicit BasePrimes(int64_t maximum)
+      : BasePrimes(maximum, [](const int64_t) {}) {}
+  // Also calls `f` for each prime >= `Indexer::kNextPrime` as it is
+  // discovered, see `SeedPrimes`.
+  template <typename F>
+  BasePrimes(int64_t maximum, F&& f)
+      : primes_(SeedPrimes(maximum, std::forward<F>(f))) {}
+
+  // The end of the range of numbers covered by the base primes. Chunks sieved
+  // above it start here.
+  int64_t end() const { return primes_.size(); }
+  // Returns the range holding the base primes, starting at 0.
+  const Range& range() const { return primes_; }
+
+  // Sieves `range` by all base primes. `range` must end at most at
+  // `end() * end()`. Base primes above the square root of its end can't mark
+  // anything in it, so they're skipped.
+  void Sieve(Range& range) const {
+    const ScopedPhase phase(Phase::kSieve);
+    const int64_t root = std::sqrt(static_cast<long double>(
+                             static_cast<uint64_t>(range.offset()) +
+                             range.size())) +
+                         1;
+    primes_.ForPrimes([&range](const int64_t p) { range.Sieve(p); }, root);
+  }
+
+ private:
+  Range primes_;
+};
+
+// Makes `base` hold the primes needed to sieve ranges ending at `end`. If it
+// doesn't yet, it's replaced by generously larger base primes, so that this
+// happens only a few times as `end` grows.
+// `Pointer` is `std::unique_ptr` or `std::shared_ptr` to `BasePrimes`.
+template <typename Pointer>
+void GrowBasePrimes(Pointer& base, const int64_t end) {
+  if (base == nullptr || base->end() < end / base->end() + 1) {
+    const int64_t maximum = base == nullptr || base->end() > (1 << 28)
+                                ? end
+                                : std::max(end, 16 * base->end() * base->end());
+    base = Pointer(new BasePrimes(maximum));
+  }
+}
+
+// Returns a range of chunk `chunk` of an interval starting at `start`, that
+// is, of `length` rows beginning at `start + chunk * kChunkSize`, sieved by
+// `base`. `start` must be a multiple of `Indexer::kSize`.
+inline Range SieveChunk(const BasePrimes& base, const int64_t start,
+                        const int64_t chunk,
+                        const int64_t length = kChunkLength) {
+  const int64_t started = Stats::enabled() ? Stats::Now() : 0;
+  Range range(start + chunk * kChunkSize, length);
+  base.Sieve(range);
+  if (Stats::enabled()) {
+    Stats::AddChunk(Stats::Now() - started);
+  }
+  return range;
+}
+
+// Calls `f` with chunks of rows sieved by `base` that together cover [lo, hi],
+// in increasing order. The first chunk may start below `lo` and the last one
+// may end above `hi`.
+template <typename F>
+void ForChunksBetween(const BasePrimes& base, int64_t lo, const int64_t hi,
+                      F&& f) {
+  lo = std::max<int64_t>(lo, 0);
+  const int64_t start = lo / Indexer::kSize * Indexer::kSize;
+  const int64_t chunk_count = hi >= lo ? (hi - start) / kChunkSize + 1 : 0;
+  for (int64_t chunk = 0; chunk < chunk_count; chunk++) {
+    f(SieveChunk(base, start, chunk,
+                 std::min<int64_t>(kChunkLength,
+                                   (hi - start - chunk * kChunkSize) /
+                                           Indexer::kSize +
+                                       1)));
+  }
+}
+
+// Calls `f` for all primes in [lo, hi] in increasing order. `base` must hold
+// primes up to at least `sqrt(hi)`.
+template <typename F>
+void ForPrimesBetween(const BasePrimes& base, const int64_t lo,
+                      const int64_t hi, F&& f) {
+  for (const int64_t p : kWheelPrimes) {
+    if (lo <= p && p <= hi) {
+      f(p);
+    }
+  }
+  ForChunksBetween(base, lo, hi, [lo, hi, &f](const Range& range) {
+    const int64_t offset = range.offset();
+    range.ForPrimes([offset, lo, hi, &f](const int64_t x) {
+      const int64_t p = x + offset;
+      if (lo <= p && p <= hi) {
+        f(p);
+      }
+    });
+  });
+}
+
+// Calls `f` for all primes in [lo, hi] in increasing order.
+template <typename F>
+void ForPrimesBetween(const int64_t lo, const int64_t hi, F&& f) {
+  ForPrimesBetween(BasePrimes(hi), lo, hi, std::forward<F>(f));
+}
+
+// Returns the part of the increasing `primes` that lies in [lo, hi].
+inline std::span<const uint64_t> PrimesWithin(
+    const std::span<const uint64_t> primes, const int64_t lo,
+    const int64_t hi) {
+  const uint64_t first = std::max<int64_t>(lo, 0);
+  const uint64_t last = std::max<int64_t>(hi, -1) + 1;
+  const auto begin = std::lower_bound(primes.begin(), primes.end(), first);
+  return {begin, std::lower_bound(begin, primes.end(), last)};
+}
+
+// Like `ForPrimesBetween`, but decodes primes into `buffer` and calls `f` with
+// `std::span<const uint64_t>` batches of them, see `Range::ForPrimeBatches`.
+// This lets `f` process many primes at once, for example using SIMD.
+template <typename F>
+void ForPrimeBatchesBetween(const BasePrimes& base, const int64_t lo,
+                            const int64_t hi, const std::span<uint64_t> buffer,
+                            F&& f) {
+  size_t wheel_primes = 0;
+  for (const int64_t p : kWheelPrimes) {
+    if (lo <= p && p <= hi) {
+      buffer[wheel_primes++] = p;
+    }
+  }
+  if (wheel_primes > 0) {
+    f(std::span<const uint64_t>(buffer.data(), wheel_primes));
+  }
+  ForChunksBetween(base, lo, hi, [lo, hi, buffer, &f](const Range& range) {
+    const bool inside =
+        lo <= range.offset() && range.offset() + range.size() <= hi + 1;
+    range.ForPrimeBatches(
+        buffer, [inside, lo, hi, &f](std::span<const uint64_t> primes) {
+          if (!inside) {
+            primes = PrimesWithin(primes, lo, hi);
+          }
+          if (!primes.empty()) {
+            f(primes);
+          }
+        });
+  });
+}
+
+// Like `ForPrimeBatchesBetween`, but in decreasing order: Chunks are sieved
+// from the highest one down and batches are sorted in decreasing order, see
+// `Range::ForPrimeBatchesReverse`. If `f` returns `bool`, stops as soon as it
+// returns false, so for example only the largest few primes below `hi` can be
+// enumerated cheaply.
+template <typename F>
+void ForPrimeBatchesBetweenReverse(const BasePrimes& base, int64_t lo,
+                                   const int64_t hi,
+                                   const std::span<uint64_t> buffer, F&& f) {
+  auto call = [&f](const std::span<const uint64_t> primes) {
+    if constexpr (std::is_same_v<
+                      std::invoke_result_t<F&, std::span<const uint64_t>>,
+                      bool>) {
+      return primes.empty() || f(primes);
+    } else {
+      if (!primes.empty()) {
+        f(primes);
+      }
+      return true;
+    }
+  };
+  lo = std::max<int64_t>(lo, 0);
+  const int64_t start = lo / Indexer::kSize * Indexer::kSize;
+  const int64_t chunk_count = hi >= lo ? (hi - start) / kChunkSize + 1 : 0;
+  for (int64_t chunk = chunk_count; chunk-- > 0;) {
+    const Range range = SieveChunk(
+        base, start, chunk,
+        std::min<int64_t>(
+            kChunkLength,
+            (hi - start - chunk * kChunkSize) / Indexer::kSize + 1));
+    const bool inside =
+        lo <= range.offset() && range.offset() + range.size() <= hi + 1;
+    if (!range.ForPrimeBatchesReverse(
+            buffer, [inside, lo, hi, &call](std::span<const uint64_t> primes) {
+              if (!inside) {
+                // `primes` is decreasing.
+                const auto first =
+                    std::lower_bound(primes.begin(), primes.end(),
+                                     static_cast<uint64_t>(hi),
+                                     std::greater<uint64_t>());
+                primes = {first, std::upper_bound(first, primes.end(),
+                                                  static_cast<uint64_t>(lo),
+                                                  std::greater<uint64_t>())};
+              }
+              return call(primes);
+            })) {
+      return;
+    }
+  }
+  size_t wheel_primes = 0;
+  for (int i = std::size(kWheelPrimes) - 1; i >= 0; i--) {
+    if (lo <= kWheelPrimes[i] && kWheelPrimes[i] <= hi) {
+      buffer[wheel_primes++] = kWheelPrimes[i];
+    }
+  }
+  call(std::span<const uint64_t>(buffer.data(), wheel_primes));
+}
+
+// Calls `f` for all primes in [lo, hi] in decreasing order. If `f` returns
+// `bool`, stops as soon as it returns false.
+template <typename F>
+void ForPrimesBetweenReverse(const BasePrimes& base, const int64_t lo,
+                             const int64_t hi, F&& f) {
+  std::vector<uint64_t> buffer(4096);
+  ForPrimeBatchesBetweenReverse(
+      base, lo, hi, std::span(buffer),
+      [&f](const std::span<const uint64_t> primes) {
+        for (const int64_t p : primes) {
+          if constexpr (std::is_same_v<std::invoke_result_t<F&, int64_t>,
+                                       bool>) {
+            if (!f(p)) {
+              return false;
+            }
+          } else {
+            f(p);
+          }
+        }
+        return true;
+      });
+}
+
+// Calls `f` for all primes in [lo, hi] in decreasing order.
+template <typename F>
+void ForPrimesBetweenReverse(const int64_t lo, const int64_t hi, F&& f) {
+  ForPrimesBetweenReverse(BasePrimes(hi), lo, hi, std::forward<F>(f));
+}
+
+// Like `ForChunksBetween`, but sieves chunks in parallel on `threads` threads
+// and in no particular order. Calls `f(range, thread)` for each chunk, where
+// `thread` is the index of the calling thread in [0, threads).
+template <typename F>
+void ParallelForChunksBetween(const BasePrimes& base, int64_t lo,
+                              const int64_t hi, const int threads, F&& f) {
+  lo = std::max<int64_t>(lo, 0);
+  const int64_t start = lo / Indexer::kSize * Indexer::kSize;
+  const int64_t chunk_count = hi >= lo ? (hi - start) / kChunkSize + 1 : 0;
+  ParallelFor(threads, chunk_count,
+              [&base, start, hi, &f](const int64_t chunk, const int thread) {
+                f(SieveChunk(base, start, chunk,
+                             std::min<int64_t>(
+                                 kChunkLength,
+                                 (hi - start - chunk * kChunkSize) /
+                                         Indexer::kSize +
+                                     1)),
+                  thread);
+              });
+}
+
+// Calls `f` with `std::span<const T>` batches computed by `window(lo, hi, out)`
+// into a `std::vector<T>` for windows of `window_size` numbers covering
+// [lo, hi], in increasing order. Up to `threads` windows are computed in
+// parallel, each into its own buffer, and then passed on in order.
+template <typename T, typename Window, typename F>
+void ForWindowsInOrder(const int64_t lo, const int64_t hi,
+                       const int64_t window_size, const int threads,
+                       Window&& window, F&& f) {
+  if (hi < lo) {
+    return;
+  }
+  const int64_t window_count = (hi - lo) / window_size + 1;
+  std::vector<std::vector<T>> buffers(threads);
+  for (int64_t begin = 0; begin < window_count; begin += threads) {
+    const int64_t count = std::min<int64_t>(threads, window_count - begin);
+    ParallelFor(threads, count, [&](const int64_t i) {
+      const int64_t start = lo + (begin + i) * window_size;
+      buffers[i].clear();
+      window(start, std::min<int64_t>(hi - start, window_size - 1) + start,
+             buffers[i]);
+    });
+    for (int64_t i = 0; i < count; i++) {
+      f(std::span<const T>(buffers[i]));
+    }
+  }
+}
+
+// Returns the number of primes in [lo, hi], sieving chunks in parallel on
+// `threads` threads. `base` must hold primes up to at least `sqrt(hi)`.
+inline int64_t CountPrimes(const BasePrimes& base, const int64_t lo,
+                           const int64_t hi, const int threads = 1) {
+  std::vector<int64_t> counts(threads);
+  for (const int64_t p : kWheelPrimes) {
+    counts[0] += lo <= p && p <= hi;
+  }
+  ParallelForChunksBetween(
+      base, lo, hi, threads, [&counts, lo, hi](const Range& range, int thread) {
+        const int64_t offset = range.offset();
+        if (lo <= offset && offset + range.size() <= hi + 1) {
+          counts[thread] += range.Count();
+        } else {
+          range.ForPrimes([&counts, thread, offset, lo, hi](const int64_t x) {
+            counts[thread] += lo <= x + offset && x + offset <= hi;
+          });
+        }
+      });
+  int64_t count = 0;
+  for (const int64_t c : counts) {
+    count += c;
+  }
+  return count;
+}
+
+// Returns the number of primes in [lo, hi] using `threads` threads.
+inline int64_t CountPrimes(const int64_t lo, const int64_t hi,
+                           const int threads = 1) {
+  return CountPrimes(BasePrimes(hi), lo, hi, threads);
+}
+
+// Lazily generates primes in [lo, hi] in increasing order.
+//
+// Unlike `ForPrimesBetween`, the consumer pulls primes one by one, for example
+// by iterating over the generator in a range-based `for` loop. The next chunk
+// is sieved only once all primes of the previous one have been consumed, and
+// base primes are extended only as far as the chunks reached so far need them.
+// So a consumer that stops early pays only for the chunks it used:
+//
+//   for (const int64_t p : PrimeGenerator(1000000000)) {
+//     if (HasProperty(p)) {
+//       return p;
+//     }
+//   }
+class PrimeGenerator {
+ public:
+  // Marks the end of the generated primes.
+  struct Sentinel {};
+
+  // An input iterator over the generated primes. All iterators of a generator
+  // share its state, so advancing one advances all of them.
+  class Iterator {
+   public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = int64_t;
+    using difference_type = ptrdiff_t;
+    using pointer = const int64_t*;
+    using reference = const int64_t&;
+
+    explicit Iterator(PrimeGenerator* generator = nullptr)
+        : generator_(generator) {}
+
+    const int64_t& operator*() const { return generator_->current(); }
+    Iterator& operator++() {
+      generator_->Advance();
+      return *this;
+    }
+    void operator++(int) { generator_->Advance(); }
+    bool operator==(Sentinel) const { return generator_->done(); }
+    bool operator!=(Sentinel) const { return !generator_->done(); }
+
+   private:
+    PrimeGenerator* generator_;
+  };
+
+  explicit PrimeGenerator(
+      const int64_t lo = 0,
+      const int64_t hi = std::numeric_limits<int64_t>::max())
+      : lo_(lo), hi_(hi), offset_(std::max<int64_t>(lo, 0) / Indexer::kSize *
+                                  Indexer::kSize) {
+    for (const int64_t p : kWheelPrimes) {
+      if (lo <= p && p <= hi) {
+        primes_.push_back(p);
+      }
+    }
+    done_ = hi < lo;
+    Fill();
+  }
+  PrimeGenerator(const PrimeGenerator&) = delete;
+  PrimeGenerator& operator=(const PrimeGenerator&) = delete;
+
+  Iterator begin() { return Iterator(this); }
+  Sentinel end() const { return Sentinel(); }
+
+  // Whether all primes have been generated.
+  bool done() const { return index_ == primes_.size(); }
+  // The current prime. Requires `!done()`.
+  const int64_t& current() const { return primes_[index_]; }
+  // Moves to the next prime. Requires `!done()`.
+  void Advance() {
+    if (++index_ == primes_.size()) {
+      primes_.clear();
+      index_ = 0;
+      Fill();
+    }
+  }
+
+ private:
+  // Sieves chunks until one contains a prime in [lo_, hi_] or `hi_` is
+  // reached.
+  void Fill() {
+    while (primes_.empty() && !done_) {
+      const int64_t rows = std::min<int64_t>(
+          kChunkLength, (hi_ - offset_) / Indexer::kSize + 1);
+      // The last chunk may extend past 2^63 - 1. It can be sieved just the
+      // same, as only its numbers up to `hi_` are used.
+      GrowBasePrimes(base_, std::min<uint64_t>(
+                                static_cast<uint64_t>(offset_) +
+                                    rows * Indexer::kSize,
+                                std::numeric_limits<int64_t>::max()));
+      Range range(offset_, rows);
+      base_->Sieve(range);
+      range.ForPrimes([this](const int64_t x) {
+        if (x <= hi_ - offset_ && lo_ <= x + offset_) {
+          primes_.push_back(x + offset_);
+        }
+      });
+      if (hi_ - offset_ < static_cast<int64_t>(kChunkSize)) {
+        done_ = true;
+      } else {
+        offset_ += kChunkSize;
+      }
+    }
+  }
+
+  const int64_t lo_;
+  const int64_t hi_;
+  // The start of the next chunk to sieve.
+  int64_t offset_;
+  // Whether all chunks have been sieved.
+  bool done_;
+  std::unique_ptr<BasePrimes> base_;
+  // Primes of the last sieved chunk, and the index of the current one.
+  std::vector<int64_t> primes_;
+  size_t index_ = 0;
+};
+
+// Returns the first prime among the numbers from `from` on in steps of
+// `step`, 1 or -1, skipping those divisible by `kWheelPrimes`. There must be
+// such a prime, at most `kLargestPrime`.
+//
+// Numbers are tested by `TestPrimes` in batches of `kPrimalityLanes`, so no
+// base primes are needed. Near `x`, a prime is expected among about
+// `ln(x) / 5` numbers on the wheel.
+inline int64_t FindPrimeOnWheel(const uint64_t from, const int step) {
+  uint64_t batch[kPrimalityLanes];
+  bool primes[kPrimalityLanes];
+  uint64_t n = from;
+  int64_t r = from % Indexer::kSize;
+  for (;;) {
+    for (size_t size = 0; size < kPrimalityLanes;) {
+      if (kIndexer.indexOf[r] >= 0) {
+        batch[size++] = n;
+      }
+      n += step;
+      r += step;
+      r = r == Indexer::kSize ? 0 : r < 0 ? Indexer::kSize - 1 : r;
+    }
+    TestPrimes(batch, primes);
+    for (size_t i = 0; i < kPrimalityLanes; i++) {
+      if (primes[i]) {
+        return batch[i];
+      }
+    }
+  }
+}
+
+// Returns the smallest prime > `x`, or -1 if it is above `kLargestPrime`.
+inline int64_t NextPrime(const int64_t x) {
+  if (x >= kLargestPrime) {
+    return -1;
+  }
+  for (const int64_t p : kWheelPrimes) {
+    if (p > x) {
+      return p;
+    }
+  }
+  return FindPrimeOnWheel(x + 1, 1);
+}
+
+// Returns the largest prime < `x`, or -1 if there is none, like
+// `NextPrime` in the other direction.
+inline int64_t PrevPrime(const int64_t x) {
+  if (x <= Indexer::kNextPrime) {
+    for (int i = std::size(kWheelPrimes) - 1; i >= 0; i--) {
+      if (kWheelPrimes[i] < x) {
+        return kWheelPrimes[i];
+      }
+    }
+    return -1;
+  }
+  // 17 is on the wheel, so the search always ends.
+  return FindPrimeOnWheel(x - 1, -1);
+}
+
+#endif  // ZILLION_PRIMES_SIEVE_H_
@@ -0,0 +1,205 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Finds candidates for `B`-smooth numbers, whose prime factors are all at most
+// `B`, in intervals by a logarithmic sieve.
+//
+// Each number gets an 8-bit accumulator starting at its logarithm, from which
+// the logarithm of `p` is subtracted at the multiples of each prime `p <= B`
+// and, optionally, of each of its powers. Numbers whose accumulator ends at
+// most at a given slack are candidates. Logarithms are in units of half a
+// bit, rounded up for the numbers' primes and factors alike, so that with
+// prime powers and any slack `>= 0`, no `B`-smooth number is missed. Some
+// other numbers with many small factors are reported as well, and the caller
+// is expected to verify candidates.
+
+#ifndef ZILLION_PRIMES_SMOOTH_H_
+#define ZILLION_PRIMES_SMOOTH_H_
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "primality.h"
+#include "sieve.h"
+
+#if defined(__AVX2__) || defined(__AVX512BW__)
+#include <immintrin.h>
+#endif
+
+// Returns `ceil(2 * log2(n))` for `n >= 1`, the rounded-up logarithm of `n`
+// in units of half a bit.
+inline int HalfBitLog(const uint64_t n) {
+  const uint128_t square = static_cast<uint128_t>(n) * n - 1;
+  const uint64_t high = square >> 64;
+  return high != 0 ? 64 + std::bit_width(high)
+                   : std::bit_width(static_cast<uint64_t>(square));
+}
+
+// Returns the largest `n` with `HalfBitLog(n) <= k` for `k` in [0, 127].
+inline uint64_t LargestWithHalfBitLog(const int k) {
+  uint64_t n = std::sqrt(std::ldexp(1.0L, k));
+  while (static_cast<uint128_t>(n) * n > uint128_t{1} << k) {
+    n--;
+  }
+  while (static_cast<uint128_t>(n + 1) * (n + 1) <= uint128_t{1} << k) {
+    n++;
+  }
+  return n;
+}
+
+// Sieves windows of consecutive numbers up to a given maximum for candidates
+// for `B`-smooth numbers.
+class LogSieve {
+ public:
+  // The most numbers in a window, processed in segments of `kSegmentSize`
+  // accumulators that fit into L2 caches.
+  static constexpr int64_t kWindowSize = int64_t{1} << 22;
+  static constexpr int64_t kSegmentSize = int64_t{1} << 16;
+
+  // Sieves by primes up to `bound`, and with `powers` also by their powers,
+  // for numbers up to `maximum`.
+  LogSieve(const int64_t bound, const int64_t maximum, const bool powers) {
+    ForPrimesBetween(0, std::min(bound, maximum), [&](const int64_t p) {
+      const int8_t log = HalfBitLog(p);
+      factors_.push_back({static_cast<uint64_t>(p), log});
+      if (powers) {
+        for (uint64_t q = p; q <= static_cast<uint64_t>(maximum) / p;) {
+          q *= p;
+          factors_.push_back({q, log});
+        }
+      }
+    });
+    std::sort(factors_.begin(), factors_.end(),
+              [](const Factor& a, const Factor& b) { return a.q < b.q; });
+  }
+
+  // Appends the candidates in [lo, hi], whose accumulators end at most at
+  // `slack`, to `out`. Requires `0 <= lo <= hi < lo + kWindowSize` and
+  // `slack` in [0, 126]. 0 is never a candidate, 1 always is.
+  void Candidates(const int64_t lo, const int64_t hi, const int slack,
+                  std::vector<uint64_t>& out) const {
+    const int64_t size = hi - lo + 1;
+    const auto end = std::upper_bound(
+        factors_.begin(), factors_.end(), static_cast<uint64_t>(hi),
+        [](const uint64_t x, const Factor& factor) { return x < factor.q; });
+    // The offset of the next multiple of each factor within the window.
+    std::vector<int64_t> next(end - factors_.begin());
+    for (size_t j = 0; j < next.size(); j++) {
+      next[j] = MinusMod(lo, factors_[j].q);
+    }
+    std::vector<int8_t> logs(kSegmentSize);
+    for (int64_t start = 0; start < size; start += kSegmentSize) {
+      const int64_t length = std::min(kSegmentSize, size - start);
+      InitializeLogs(lo + start, length, logs.data());
+      for (size_t j = 0; j < next.size(); j++) {
+        const Factor factor = factors_[j];
+        int64_t i = next[j] - start;
+        for (; i < length; i += factor.q) {
+          logs[i] -= factor.log;
+        }
+        next[j] = i + start;
+      }
+      if (lo + start == 0) {
+        logs[0] = INT8_MAX;
+      }
+      Scan(logs.data(), length, slack, lo + start, out);
+    }
+  }
+
+ private:
+  // A prime or prime power `q` with the rounded-up logarithm of its prime.
+  struct Factor {
+    uint64_t q;
+    int8_t log;
+  };
+
+  // Sets `logs` to the logarithms of the `length` numbers from `first` on.
+  // They only change at the powers of `sqrt(2)`, so runs of equal values are
+  // filled at once.
+  static void InitializeLogs(const uint64_t first, const int64_t length,
+                             int8_t* logs) {
+    for (int64_t i = 0; i < length;) {
+      const uint64_t n = std::max<uint64_t>(first + i, 1);
+      const int log = HalfBitLog(n);
+      const int64_t run = std::min<uint64_t>(
+          LargestWithHalfBitLog(log) - (first + i) + 1, length - i);
+      std::fill_n(logs + i, run, log);
+      i += run;
+    }
+  }
+
+  // Appends `first + i` for each `logs[i] <= slack` among the `length`
+  // accumulators to `out`, comparing a vector of them at once.
+  static void Scan(const int8_t* logs, const int64_t length, const int slack,
+                   const uint64_t first, std::vector<uint64_t>& out) {
+    int64_t i = 0;
+#if defined(__AVX512BW__)
+    const __m512i threshold = _mm512_set1_epi8(slack + 1);
+    for (; i + 64 <= length; i += 64) {
+      uint64_t mask = _mm512_cmplt_epi8_mask(_mm512_loadu_si512(logs + i),
+                                             threshold);
+      for (; mask != 0; mask &= mask - 1) {
+        out.push_back(first + i + std::countr_zero(mask));
+      }
+    }
+#elif defined(__AVX2__)
+    const __m256i threshold = _mm256_set1_epi8(slack + 1);
+    for (; i + 32 <= length; i += 32) {
+      const __m256i values =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(logs + i));
+      uint32_t mask =
+          _mm256_movemask_epi8(_mm256_cmpgt_epi8(threshold, values));
+      for (; mask != 0; mask &= mask - 1) {
+        out.push_back(first + i + std::countr_zero(mask));
+      }
+    }
+#endif
+    for (; i < length; i++) {
+      if (logs[i] <= slack) {
+        out.push_back(first + i);
+      }
+    }
+  }
+
+  // All factors up to the maximum, increasing.
+  std::vector<Factor> factors_;
+};
+
+// Calls `f` with `std::span<const uint64_t>` batches of the candidates for
+// `bound`-smooth numbers in [lo, hi] in increasing order, see `LogSieve`,
+// sieving windows in parallel on `threads` threads.
+template <typename F>
+void ForSmoothCandidates(int64_t lo, const int64_t hi, const int64_t bound,
+                         const int slack, const bool powers, const int threads,
+                         F&& f) {
+  lo = std::max<int64_t>(lo, 0);
+  if (hi < lo) {
+    return;
+  }
+  const LogSieve sieve(bound, hi, powers);
+  ForWindowsInOrder<uint64_t>(
+      lo, hi, LogSieve::kWindowSize, threads,
+      [&sieve, slack](const int64_t lo, const int64_t hi,
+                      std::vector<uint64_t>& out) {
+        sieve.Candidates(lo, hi, slack, out);
+      },
+      std::forward<F>(f));
+}
+
+#endif  // ZILLION_PRIMES_SMOOTH_H_
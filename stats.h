@@ -0,0 +1,217 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Statistics of a run: the time spent in each phase of the sieve, the primes
+// and bytes written, the chunks sieved with a histogram of their latencies,
+// and the peak memory use.
+//
+// Phases are timed by `ScopedPhase` into counters local to each thread, which
+// are added to the totals when the thread ends. A phase started within
+// another one pauses it, so that no time is counted twice. Unless
+// `Stats::Enable` is called, each of the hooks costs a single branch.
+
+#ifndef ZILLION_PRIMES_STATS_H_
+#define ZILLION_PRIMES_STATS_H_
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <ostream>
+
+// The phases of the sieve timed by `ScopedPhase`.
+enum class Phase {
+  kSeed,    // Seeding the base primes, see `SeedPrimes`.
+  kSieve,   // Sieving chunks by the base primes.
+  kDecode,  // Decoding sieved bits into primes.
+  kWrite,   // Encoding and writing primes out.
+};
+
+// The counters of `Stats`, for a single thread or in total.
+struct StatsCounters {
+  static constexpr int kPhases = 4;
+  // Bucket `i > 0` of the histogram of chunk latencies counts chunks that
+  // took [2^(i - 1), 2^i) microseconds, bucket 0 those that took less.
+  static constexpr int kBuckets = 32;
+
+  // The nanoseconds spent in each `Phase`.
+  int64_t nanos[kPhases] = {};
+  int64_t primes = 0;
+  int64_t bytes = 0;
+  int64_t chunks = 0;
+  int64_t latencies[kBuckets] = {};
+
+  void Add(const StatsCounters& other) {
+    for (int i = 0; i < kPhases; i++) {
+      nanos[i] += other.nanos[i];
+    }
+    primes += other.primes;
+    bytes += other.bytes;
+    chunks += other.chunks;
+    for (int i = 0; i < kBuckets; i++) {
+      latencies[i] += other.latencies[i];
+    }
+  }
+};
+
+// Collects the statistics of the whole program.
+class Stats {
+ public:
+  static constexpr int kPhases = StatsCounters::kPhases;
+  static constexpr int kBuckets = StatsCounters::kBuckets;
+
+  // Starts collecting statistics. Must be called before starting any threads.
+  static void Enable() {
+    enabled_ = true;
+    start_ = Now();
+  }
+  static bool enabled() { return enabled_; }
+
+  // The current time in nanoseconds.
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Counts a chunk sieved in `nanos` nanoseconds.
+  static void AddChunk(const int64_t nanos) {
+    if (!enabled_) {
+      return;
+    }
+    StatsCounters& counters = local().counters;
+    counters.chunks++;
+    counters.latencies[std::min<int>(
+        std::bit_width(static_cast<uint64_t>(nanos / 1000)), kBuckets - 1)]++;
+  }
+
+  // Counts `primes` written out as `bytes`.
+  static void AddOutput(const int64_t primes, const int64_t bytes) {
+    if (!enabled_) {
+      return;
+    }
+    StatsCounters& counters = local().counters;
+    counters.primes += primes;
+    counters.bytes += bytes;
+  }
+
+  // Writes the statistics collected so far by all threads that have ended
+  // and by the calling one to `out`.
+  static void Report(std::ostream& out) {
+    StatsCounters totals;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      totals = totals_;
+    }
+    totals.Add(local().counters);
+    const double seconds = (Now() - start_) * 1e-9;
+    static constexpr const char* kNames[kPhases] = {"seed", "sieve", "decode",
+                                                    "write"};
+    out << std::fixed << std::setprecision(3) << "time: " << seconds
+        << " s\n";
+    for (int i = 0; i < kPhases; i++) {
+      out << "  " << kNames[i] << ": " << totals.nanos[i] * 1e-9
+          << " s (all threads)\n";
+    }
+    out << std::setprecision(0) << "primes: " << totals.primes << " ("
+        << totals.primes / seconds << "/s)\n"
+        << "bytes: " << totals.bytes << " (" << totals.bytes / seconds
+        << "/s)\n"
+        << "chunks: " << totals.chunks << '\n';
+    for (int i = 0; i < kBuckets; i++) {
+      if (totals.latencies[i] > 0) {
+        out << "  " << (i == 0 ? 0 : int64_t{1} << (i - 1)) << '-'
+            << (int64_t{1} << i) << " us: " << totals.latencies[i] << '\n';
+      }
+    }
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+      out << "peak rss: " << usage.ru_maxrss << " KiB\n";
+    }
+  }
+
+ private:
+  friend class ScopedPhase;
+
+  // The counters of a thread and its running phase, if any.
+  struct Local {
+    StatsCounters counters;
+    bool running = false;
+    Phase phase = Phase::kSeed;
+    // When `phase` started or was last resumed.
+    int64_t since = 0;
+
+    ~Local() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      totals_.Add(counters);
+    }
+  };
+
+  static Local& local() {
+    thread_local Local local;
+    return local;
+  }
+
+  inline static bool enabled_ = false;
+  inline static int64_t start_ = 0;
+  inline static std::mutex mutex_;
+  inline static StatsCounters totals_;
+};
+
+// Counts the time from construction to destruction towards `phase` of the
+// running thread, pausing the phase it interrupts.
+class ScopedPhase {
+ public:
+  explicit ScopedPhase(const Phase phase) {
+    if (!Stats::enabled()) {
+      return;
+    }
+    active_ = true;
+    Stats::Local& local = Stats::local();
+    const int64_t now = Stats::Now();
+    if (local.running) {
+      local.counters.nanos[static_cast<int>(local.phase)] += now - local.since;
+    }
+    outer_running_ = local.running;
+    outer_ = local.phase;
+    local.running = true;
+    local.phase = phase;
+    local.since = now;
+  }
+  ScopedPhase(const ScopedPhase&) = delete;
+  ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+  ~ScopedPhase() {
+    if (!active_) {
+      return;
+    }
+    Stats::Local& local = Stats::local();
+    const int64_t now = Stats::Now();
+    local.counters.nanos[static_cast<int>(local.phase)] += now - local.since;
+    local.running = outer_running_;
+    local.phase = outer_;
+    local.since = now;
+  }
+
+ private:
+  bool active_ = false;
+  bool outer_running_ = false;
+  Phase outer_ = Phase::kSeed;
+};
+
+#endif  // ZILLION_PRIMES_STATS_H_
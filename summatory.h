@@ -0,0 +1,205 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Computes the Mertens function `M(x) = mu(1) + ... + mu(x)` and the
+// summatory totient `Phi(x) = phi(1) + ... + phi(x)` in O(x^(2/3)) time,
+// without sieving all numbers up to `x`.
+//
+// Both are summatory functions `F` of functions `f` whose Dirichlet
+// convolution with 1 has a simple summatory function `G`, so that
+//
+//   F(v) = G(v) - sum over d in [2, v] of F(v / d)
+//
+// For `M`, `G(v) = 1`, and for `Phi`, `G(v) = v (v + 1) / 2`. With
+// `s = floor(sqrt(v))`, the terms with `d > s` are grouped by `q = v / d`:
+//
+//   F(v) = G(v) - sum over d in [2, s] of F(v / d)
+//               - sum over q in [1, v / (s + 1)] of (v / q - v / (q + 1)) F(q)
+//
+// Only the values `F(x / k)` for `k <= K` above a bound `y ~ x^(2/3)` are
+// computed by this recursion, from `k = K` down to 1. All terms with
+// arguments up to `y` are instead collected while `f` is sieved window by
+// window over [1, y], keeping the running `F` of the window. Each `k` waits
+// in a bucket of the window of its next such argument, so that a window only
+// visits the `k` that need it.
+
+#ifndef ZILLION_PRIMES_SUMMATORY_H_
+#define ZILLION_PRIMES_SUMMATORY_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "arithmetic.h"
+#include "factor.h"
+#include "pi.h"
+#include "primality.h"
+#include "sieve.h"
+
+// The Moebius function, for `SummatoryFunction` computing `M(x)`.
+struct MertensFunction {
+  using Summand = Moebius;
+  using Value = int64_t;
+
+  static Value Convolved(int64_t) { return 1; }
+};
+
+// Euler's totient, for `SummatoryFunction` computing `Phi(x)`. Sums are exact
+// for all `x < 2^63`.
+struct TotientFunction {
+  using Summand = EulerPhi;
+  using Value = uint128_t;
+
+  static Value Convolved(const int64_t v) {
+    return static_cast<uint128_t>(v) * (v + 1) / 2;
+  }
+};
+
+// Returns `F(x)` for the summatory function `F` of `Function`, one of the
+// above, using `threads` threads. The result doesn't depend on `threads`.
+//
+// `Function::Summand` is the arithmetic function `f`, see arithmetic.h, and
+// `Function::Value` the type of its sums.
+template <typename Function>
+typename Function::Value SummatoryFunction(const int64_t x,
+                                           const int threads = 1) {
+  using Summand = typename Function::Summand;
+  using Value = typename Function::Value;
+  if (x < 1) {
+    return 0;
+  }
+  // The sieved region [1, y] and the number of values `x / k > y`.
+  const int64_t cbrt_x = IntegerCbrt(x);
+  const int64_t y = std::min(x, std::max(IntegerSqrt(x), cbrt_x * cbrt_x));
+  const int64_t k_count = x / (y + 1);
+  // For each `k`, the number of terms visited so far. The first
+  // `grouped[k]` terms are those with `q in [1, v / (s + 1)]`, the remaining
+  // ones those with `d` from `s` down to the first `d` with `x / (k d) <= y`.
+  std::vector<int64_t> roots(k_count + 1);
+  std::vector<int64_t> grouped(k_count + 1);
+  std::vector<int64_t> terms(k_count + 1);
+  std::vector<int64_t> visited(k_count + 1);
+  std::vector<Value> sums(k_count + 1);
+  // Returns the argument `q` of term `t` of `k`.
+  auto argument = [&](const int64_t k, const int64_t t) {
+    return t < grouped[k] ? t + 1 : x / k / (roots[k] - (t - grouped[k]));
+  };
+  // Smaller windows than for factoring, so that they fit into L2 caches.
+  constexpr int64_t kWindowSize = int64_t{1} << 16;
+  std::vector<std::vector<int64_t>> buckets((y - 1) / kWindowSize + 1);
+  for (int64_t k = 1; k <= k_count; k++) {
+    const int64_t v = x / k;
+    roots[k] = IntegerSqrt(v);
+    grouped[k] = v / (roots[k] + 1);
+    terms[k] = grouped[k] + std::max<int64_t>(
+                                roots[k] - std::max<int64_t>(k_count / k, 1),
+                                0);
+    if (terms[k] > 0) {
+      buckets[(argument(k, 0) - 1) / kWindowSize].push_back(k);
+    }
+  }
+  // Adds the next terms of `k` with arguments up to `hi` to `sums[k]`, given
+  // the values of `F` in [lo, hi]. The weights of grouped terms are
+  // differences of consecutive quotients, so each term costs one division.
+  auto add_terms = [&](const int64_t k, const int64_t lo, const int64_t hi,
+                       const Value* window_sums) {
+    const int64_t v = x / k;
+    int64_t t = visited[k];
+    Value sum = sums[k];
+    if (t < grouped[k]) {
+      for (int64_t upper = v / (t + 1); t < grouped[k] && t + 1 <= hi; t++) {
+        const int64_t lower = v / (t + 2);
+        sum += static_cast<Value>(upper - lower) * window_sums[t + 1 - lo];
+        upper = lower;
+      }
+    }
+    if (t >= grouped[k]) {
+      for (int64_t d = roots[k] - (t - grouped[k]); t < terms[k]; t++, d--) {
+        const int64_t q = v / d;
+        if (q > hi) {
+          break;
+        }
+        sum += window_sums[q - lo];
+      }
+    }
+    sums[k] = sum;
+    visited[k] = t;
+  };
+  // The running `F` before the current window, and the window's `F`.
+  Value before = 0;
+  std::vector<Value> window_sums;
+  int64_t window = 0;
+  // Per thread, the buckets of the next terms as `{window, k}`.
+  std::vector<std::vector<std::pair<int64_t, int64_t>>> moves(threads);
+  ForFactorWindows<typename Summand::Value>(
+      1, y, threads, EvaluateWindow<Summand>,
+      [&](const std::span<const typename Summand::Value> values) {
+        const int64_t lo = 1 + window * kWindowSize;
+        const int64_t hi = lo + values.size() - 1;
+        window_sums.resize(values.size());
+        for (size_t i = 0; i < values.size(); i++) {
+          before += values[i];
+          window_sums[i] = before;
+        }
+        // Small buckets aren't worth starting threads for.
+        const std::vector<int64_t>& bucket = buckets[window];
+        ParallelFor(std::min<int64_t>(threads, bucket.size() / 4096 + 1),
+                    bucket.size(), [&](const int64_t i, const int thread) {
+                      const int64_t k = bucket[i];
+                      add_terms(k, lo, hi, window_sums.data());
+                      if (visited[k] < terms[k]) {
+                        moves[thread].push_back(
+                            {(argument(k, visited[k]) - 1) / kWindowSize, k});
+                      }
+                    });
+        for (auto& thread_moves : moves) {
+          for (const auto& [next, k] : thread_moves) {
+            buckets[next].push_back(k);
+          }
+          thread_moves.clear();
+        }
+        buckets[window].clear();
+        buckets[window].shrink_to_fit();
+        window++;
+      },
+      kWindowSize);
+  if (k_count == 0) {
+    return before;
+  }
+  // `sums[k]` becomes `F(x / k)`.
+  for (int64_t k = k_count; k >= 1; k--) {
+    Value value = Function::Convolved(x / k) - sums[k];
+    for (int64_t d = 2; k * d <= k_count; d++) {
+      value -= sums[k * d];
+    }
+    sums[k] = value;
+  }
+  return sums[1];
+}
+
+// Returns the Mertens function `M(x)` using `threads` threads.
+inline int64_t Mertens(const int64_t x, const int threads = 1) {
+  return SummatoryFunction<MertensFunction>(x, threads);
+}
+
+// Returns `Phi(x)`, the sum of Euler's totients up to `x`, using `threads`
+// threads.
+inline uint128_t SumTotients(const int64_t x, const int threads = 1) {
+  return SummatoryFunction<TotientFunction>(x, threads);
+}
+
+#endif  // ZILLION_PRIMES_SUMMATORY_H_
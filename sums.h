@@ -0,0 +1,170 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Sums of primes and of their squares.
+//
+// All sums are computed in `unsigned __int128` arithmetic, that is modulo
+// 2^128. Since only additions, subtractions and multiplications are involved,
+// intermediate overflows cancel out and results are exact whenever the true
+// value fits into 128 bits. For the sum of squares of primes up to `x` that
+// holds for `x` up to `kMaxPrimeSums`.
+
+#ifndef ZILLION_PRIMES_SUMS_H_
+#define ZILLION_PRIMES_SUMS_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <span>
+#include <string>
+#include <vector>
+
+#include "pi.h"
+#include "primality.h"
+#include "sieve.h"
+
+// The largest bound for which the sums are exact. The sum of squares of the
+// primes up to the next prime, 31543762261367, is at least 2^128.
+inline constexpr int64_t kMaxPrimeSums = 31543762261366;
+
+// The number of primes in an interval, their sum and the sum of their squares.
+struct PrimeSums {
+  int64_t count = 0;
+  uint128_t sum = 0;
+  uint128_t sum_of_squares = 0;
+
+  PrimeSums& operator+=(const PrimeSums& other) {
+    count += other.count;
+    sum += other.sum;
+    sum_of_squares += other.sum_of_squares;
+    return *this;
+  }
+};
+
+// Formats `x` in decimal.
+inline std::string ToString(uint128_t x) {
+  std::string digits;
+  do {
+    digits.push_back('0' + static_cast<int>(x % 10));
+    x /= 10;
+  } while (x > 0);
+  std::reverse(digits.begin(), digits.end());
+  return digits;
+}
+
+// Returns the sums over primes in [lo, hi], sieving chunks in parallel on
+// `threads` threads. Each thread decodes primes in batches and accumulates
+// them into its own sums, which are added up at the end. `base` must hold
+// primes up to at least `sqrt(hi)`.
+inline PrimeSums SumPrimes(const BasePrimes& base, const int64_t lo,
+                           const int64_t hi, const int threads = 1) {
+  std::vector<PrimeSums> sums(threads);
+  auto add = [&sums](const std::span<const uint64_t> primes, int thread) {
+    PrimeSums& s = sums[thread];
+    s.count += primes.size();
+    for (const uint64_t p : primes) {
+      s.sum += p;
+      s.sum_of_squares += static_cast<uint128_t>(p) * p;
+    }
+  };
+  for (const int64_t p : kWheelPrimes) {
+    if (lo <= p && p <= hi) {
+      const uint64_t primes[] = {static_cast<uint64_t>(p)};
+      add(primes, 0);
+    }
+  }
+  ParallelForChunksBetween(
+      base, lo, hi, threads, [lo, hi, &add](const Range& range, int thread) {
+        const bool inside =
+            lo <= range.offset() && range.offset() + range.size() <= hi + 1;
+        std::vector<uint64_t> buffer(4096);
+        range.ForPrimeBatches(
+            buffer, [inside, lo, hi, thread,
+                     &add](const std::span<const uint64_t> primes) {
+              add(inside ? primes : PrimesWithin(primes, lo, hi), thread);
+            });
+      });
+  PrimeSums total;
+  for (const PrimeSums& s : sums) {
+    total += s;
+  }
+  return total;
+}
+
+// Returns the sums over primes in [lo, hi] using `threads` threads.
+inline PrimeSums SumPrimes(const int64_t lo, const int64_t hi,
+                           const int threads) {
+  return SumPrimes(BasePrimes(hi), lo, hi, threads);
+}
+
+// Returns `sum(n^k)` for `n` in [2, v] and `k` in {0, 1, 2}, modulo 2^128.
+inline PrimeSums SumPowersFrom2(const uint64_t v) {
+  // Divide the factors of v (v + 1) / 2 and v (v + 1) (2 v + 1) / 6 before
+  // multiplying, so that the results are exact modulo 2^128.
+  uint128_t a = v;
+  uint128_t b = v + 1;
+  uint128_t c = 2 * a + 1;
+  (a % 2 == 0 ? a : b) /= 2;
+  const uint128_t sum = a * b;
+  (a % 3 == 0 ? a : b % 3 == 0 ? b : c) /= 3;
+  return {static_cast<int64_t>(v) - 1, sum - 1, a * b * c - 1};
+}
+
+// Returns the sums over primes up to `x` in O(x^(3/4)) time and O(sqrt(x))
+// memory, using the Lucy_Hedgehog variant of Legendre's method.
+//
+// For every `v` of the form `x / i`, `S(v, p)` holds the sums over numbers in
+// [2, v] that are either prime or have no prime factor <= p. Starting from all
+// numbers, `S(v, p) = S(v, p - 1) - p^k (S(v / p, p - 1) - S(p - 1, p - 1))`
+// removes those whose least prime factor is `p`. At the end, `S(x, sqrt(x))`
+// holds the sums over primes.
+inline PrimeSums SumPrimes(const int64_t x) {
+  if (x < 2) {
+    return {};
+  }
+  const int64_t r = IntegerSqrt(x);
+  // `small[v]` for `v <= r` and `large[i]` for `v = x / i > r`.
+  std::vector<PrimeSums> small(r + 1);
+  std::vector<PrimeSums> large(x / r > r ? r + 1 : r);
+  for (int64_t v = 1; v <= r; v++) {
+    small[v] = SumPowersFrom2(v);
+  }
+  for (int64_t i = 1; i < std::ssize(large); i++) {
+    large[i] = SumPowersFrom2(x / i);
+  }
+  auto at = [x, r, &small, &large](const int64_t v) -> PrimeSums& {
+    return v <= r ? small[v] : large[x / v];
+  };
+  for (int64_t p = 2; p <= r; p++) {
+    if (small[p].count == small[p - 1].count) {
+      continue;  // Not a prime.
+    }
+    const PrimeSums below = small[p - 1];
+    const uint128_t p2 = static_cast<uint128_t>(p) * p;
+    const int64_t square = p * p;
+    auto remove = [p, p2, &below](PrimeSums& s, const PrimeSums& quotient) {
+      s.count -= quotient.count - below.count;
+      s.sum -= p * (quotient.sum - below.sum);
+      s.sum_of_squares -= p2 * (quotient.sum_of_squares - below.sum_of_squares);
+    };
+    for (int64_t i = 1; i < std::ssize(large) && x / i >= square; i++) {
+      remove(large[i], at(x / i / p));
+    }
+    for (int64_t v = r; v >= square; v--) {
+      remove(small[v], small[v / p]);
+    }
+  }
+  return at(x);
+}
+
+#endif  // ZILLION_PRIMES_SUMS_H_
@@ -0,0 +1,247 @@
+// Copyright 2024 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Finds prime k-tuples, such as twin primes `(p, p + 2)` or prime quadruplets
+// `(p, p + 2, p + 6, p + 8)`, directly in the bits of sieved `Range`-s.
+
+#ifndef ZILLION_PRIMES_TUPLES_H_
+#define ZILLION_PRIMES_TUPLES_H_
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "sieve.h"
+
+// A pattern of offsets `0 = d_0 < d_1 < ... < d_{k-1} <= kMaxSpan`. Prime
+// `p` starts a tuple if all `p + d_i` are primes.
+//
+// In a `Range`, the bits of numbers `r` and `r + d` not divisible by
+// `kWheelPrimes` are a fixed number of bits apart, which depends only on
+// `r mod Indexer::kSize`. So the bit positions are grouped by these distances
+// for all `d_i`. For each group, a word of start bits is then computed from a
+// word of prime bits by `k - 1` shifts and ANDs, and masked to the positions
+// of the group. Positions at which not all `r + d_i` are coprime to
+// `Indexer::kSize` belong to no group.
+class TuplePattern {
+ public:
+  static constexpr int64_t kMaxSpan = 64;
+
+  // `offsets` must be increasing, start with 0 and end at most at `kMaxSpan`.
+  explicit TuplePattern(std::vector<int64_t> offsets)
+      : offsets_(std::move(offsets)) {
+    // Groups by their distances, in a deterministic order.
+    std::map<std::vector<int>, Group> groups;
+    for (int64_t i = 0; i < Indexer::kBits; i++) {
+      const int64_t r = kIndexer.atIndex[i];
+      std::vector<int> shifts;
+      for (size_t j = 1; j < offsets_.size(); j++) {
+        const int64_t n = r + offsets_[j];
+        const ptrdiff_t index = kIndexer.indexOf[n % Indexer::kSize];
+        if (index < 0) {
+          break;
+        }
+        shifts.push_back(n / Indexer::kSize * Indexer::kBits + index - i);
+      }
+      if (shifts.size() + 1 == offsets_.size()) {
+        Group& group = groups[shifts];
+        group.shifts = shifts;
+        group.masks[i / 64] |= uint64_t{1} << (i % 64);
+      }
+    }
+    for (auto& [shifts, group] : groups) {
+      groups_.push_back(group);
+    }
+  }
+
+  const std::vector<int64_t>& offsets() const { return offsets_; }
+
+  // Returns the start bits for the word of prime bits `primes` at index
+  // `word` of a range, given the prime bits of the next word `next`.
+  uint64_t Match(const uint64_t primes, const uint64_t next,
+                 const size_t word) const {
+    uint64_t starts = 0;
+    for (const Group& group : groups_) {
+      uint64_t bits = primes & group.masks[word % Range::kWords];
+      for (size_t j = 0; bits != 0 && j < group.shifts.size(); j++) {
+        const int shift = group.shifts[j];
+        bits &= (primes >> shift) | (next << (64 - shift));
+      }
+      starts |= bits;
+    }
+    return starts;
+  }
+
+  // Returns whether `p < Indexer::kNextPrime` starts a tuple whose numbers are
+  // all at most `hi`. Such tuples include primes not represented in `Range`.
+  bool IsSmallTuple(const int64_t p, const int64_t hi) const {
+    auto is_prime = [](const int64_t n) {
+      if (n < 2) {
+        return false;
+      }
+      for (int64_t d = 2; d * d <= n; d++) {
+        if (n % d == 0) {
+          return false;
+        }
+      }
+      return true;
+    };
+    if (p + offsets_.back() > hi) {
+      return false;
+    }
+    for (const int64_t d : offsets_) {
+      if (!is_prime(p + d)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+ private:
+  // Bit positions with the same distances `shifts` to the other numbers of a
+  // tuple. As the distances are at most `kMaxSpan / 2`, they're below 64.
+  struct Group {
+    std::vector<int> shifts;
+    uint64_t masks[Range::kWords] = {};
+  };
+
+  std::vector<int64_t> offsets_;
+  std::vector<Group> groups_;
+};
+
+// Returns the prime bits of `range`, that is, its complemented words, with
+// bits of numbers outside [lo, hi] cleared.
+inline std::vector<uint64_t> PrimeWords(const Range& range, const int64_t lo,
+                                        const int64_t hi) {
+  std::vector<uint64_t> words(range.words().size());
+  std::transform(range.words().begin(), range.words().end(), words.begin(),
+                 [](const uint64_t word) { return ~word; });
+  if (lo <= range.offset() && range.offset() + range.size() <= hi + 1) {
+    return words;
+  }
+  for (size_t j = 0; j < words.size(); j++) {
+    const int64_t offset =
+        range.offset() + j / Range::kWords * Indexer::kSize;
+    const int64_t* at = &kIndexer.atIndex[j % Range::kWords * 64];
+    for (uint64_t bits = words[j]; bits != 0; bits &= bits - 1) {
+      const int index = std::countr_zero(bits);
+      if (offset + at[index] < lo || offset + at[index] > hi) {
+        words[j] &= ~(uint64_t{1} << index);
+      }
+    }
+  }
+  return words;
+}
+
+// Returns the number of tuples of `pattern` with all their numbers in
+// [lo, hi], sieving chunks in parallel on `threads` threads. `base` must hold
+// primes up to at least `sqrt(hi)`.
+//
+// The last word of each chunk needs the first word of the next one, so it's
+// matched only once all chunks are done.
+inline int64_t CountTuples(const BasePrimes& base, const TuplePattern& pattern,
+                           int64_t lo, const int64_t hi,
+                           const int threads = 1) {
+  lo = std::max<int64_t>(lo, 0);
+  int64_t count = 0;
+  for (int64_t p = lo; p < Indexer::kNextPrime && p <= hi; p++) {
+    count += pattern.IsSmallTuple(p, hi);
+  }
+  const int64_t start = lo / Indexer::kSize * Indexer::kSize;
+  const int64_t chunk_count = hi >= lo ? (hi - start) / kChunkSize + 1 : 0;
+  std::vector<int64_t> counts(threads);
+  std::vector<uint64_t> firsts(chunk_count);
+  std::vector<uint64_t> lasts(chunk_count);
+  ParallelForChunksBetween(
+      base, lo, hi, threads, [&](const Range& range, const int thread) {
+        const int64_t chunk = (range.offset() - start) / kChunkSize;
+        const std::vector<uint64_t> words = PrimeWords(range, lo, hi);
+        for (size_t j = 0; j + 1 < words.size(); j++) {
+          counts[thread] +=
+              std::popcount(pattern.Match(words[j], words[j + 1], j));
+        }
+        firsts[chunk] = words.front();
+        lasts[chunk] = words.back();
+      });
+  for (int64_t chunk = 0; chunk < chunk_count; chunk++) {
+    const uint64_t next = chunk + 1 < chunk_count ? firsts[chunk + 1] : 0;
+    count += std::popcount(
+        pattern.Match(lasts[chunk], next, Range::kWords - 1));
+  }
+  for (const int64_t c : counts) {
+    count += c;
+  }
+  return count;
+}
+
+// Calls `f` with `std::span<const uint64_t>` batches of the first primes of
+// tuples of `pattern` with all their numbers in [lo, hi], in increasing
+// order. Batches are decoded into `buffer`, see `Range::ForPrimeBatches`.
+template <typename F>
+void ForTupleBatchesBetween(const BasePrimes& base,
+                            const TuplePattern& pattern, int64_t lo,
+                            const int64_t hi, const std::span<uint64_t> buffer,
+                            F&& f) {
+  lo = std::max<int64_t>(lo, 0);
+  size_t small = 0;
+  for (int64_t p = lo; p < Indexer::kNextPrime && p <= hi; p++) {
+    if (pattern.IsSmallTuple(p, hi)) {
+      buffer[small++] = p;
+    }
+  }
+  if (small > 0) {
+    f(std::span<const uint64_t>(buffer.data(), small));
+  }
+  // The last word of the previous chunk, waiting for the next one.
+  uint64_t last = 0;
+  int64_t last_offset = -1;
+  uint64_t* out = buffer.data();
+  uint64_t* const end = buffer.data() + buffer.size() - 64;
+  auto put = [&](const uint64_t starts, const size_t word,
+                 const int64_t row_offset) {
+    if (out > end) {
+      f(std::span<const uint64_t>(buffer.data(), out));
+      out = buffer.data();
+    }
+    out = DecodeWord(starts, &kIndexer.atIndex[word % Range::kWords * 64],
+                     row_offset, out);
+  };
+  ForChunksBetween(base, lo, hi, [&](const Range& range) {
+    const std::vector<uint64_t> words = PrimeWords(range, lo, hi);
+    if (last_offset >= 0) {
+      put(pattern.Match(last, words.front(), Range::kWords - 1),
+          Range::kWords - 1, last_offset);
+    }
+    for (size_t j = 0; j + 1 < words.size(); j++) {
+      put(pattern.Match(words[j], words[j + 1], j), j,
+          range.offset() + j / Range::kWords * Indexer::kSize);
+    }
+    last = words.back();
+    last_offset = range.offset() + range.size() - Indexer::kSize;
+  });
+  if (last_offset >= 0) {
+    put(pattern.Match(last, 0, Range::kWords - 1), Range::kWords - 1,
+        last_offset);
+  }
+  if (out != buffer.data()) {
+    f(std::span<const uint64_t>(buffer.data(), out));
+  }
+}
+
+#endif  // ZILLION_PRIMES_TUPLES_H_